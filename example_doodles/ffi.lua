@@ -0,0 +1,43 @@
+-- run with doodle -f, draws through the ffi module so the loops get compiled
+width = 1000
+height = 1000
+background = BLUE
+
+local point, color = doodle.point, doodle.color
+local circle, line = doodle.circle, doodle.line
+
+local white = color(WHITE)
+local red = color(RED)
+local black = color(BLACK)
+
+function circle_circle(origin, offset, radius, count, color)
+    local angle = math.pi * 2 / count
+
+    for i = 0, count - 1 do
+        circle(origin:polar_offset(angle * i, offset), radius, color)
+    end
+end
+
+function star(origin, radius)
+    local angle = -math.pi / 2
+    for _ = 1, 5 do
+        local nangle = angle + math.pi * 4 / 5
+        line(
+            origin:polar_offset(angle, radius),
+            origin:polar_offset(nangle, radius),
+            height / 100,
+            red
+        )
+        angle = nangle
+    end
+end
+
+local center = point(width / 2, height / 2)
+for ring = 1, 40 do
+    circle_circle(center, ring * height / 90, height / 200, ring * 8, white)
+end
+circle_circle(center, height / 4, height / 40, 10, black)
+
+for i = 1, 12 do
+    star(center:polar_offset(i * 2 * math.pi / 12, height / 2.5), height / 20)
+end
@@ -0,0 +1,171 @@
+import { spawn, type ChildProcessWithoutNullStreams } from 'child_process';
+
+// A render answered by the daemon, status is 0 on success or the failed
+// step's doodle_lua_error_type + 1, data the image or error message. Renders
+// written to an outputPath answer with the file's size instead of the image.
+export type RenderResult = {
+  status: RenderStatus;
+  data: Buffer;
+};
+
+// limits of 0 leave the daemon's own in place
+export type RenderLimits = {
+  memory: number; // bytes
+  cpuTime: number; // milliseconds
+};
+
+// doodle_png_profile
+export enum PngProfile {
+  Balanced = 0,
+  Fastest,
+  Smallest,
+}
+
+// doodle_file_type
+export enum FileType {
+  Ppm = 0,
+  Png,
+  Pam,
+  Raw,
+  Qoi,
+}
+
+// outputPath has the daemon write the image there itself, best on a tmpfs
+// like /dev/shm, rather than sending it back. Nothing may exist there yet.
+export type RenderOptions = {
+  pngProfile: PngProfile;
+  fileType: FileType;
+  outputPath?: string;
+};
+
+// doodle_lua_error_type + 1, as sent in a response's status
+export enum RenderStatus {
+  Ok = 0,
+  UnsetGlobal,
+  BadGlobalType,
+  InitFail,
+  LoadFail,
+  RunFail,
+  ImageFail,
+  MemoryLimit,
+  TimeLimit,
+  DrawLimit,
+  PixelLimit,
+}
+
+type Pending = {
+  resolve: (result: RenderResult) => void;
+  reject: (error: Error) => void;
+};
+
+// Keeps one `doodle -D` process running and feeds it scripts along with
+// their limits and options. Responses come back in the order jobs were written.
+export class DoodleDaemon {
+  private process: ChildProcessWithoutNullStreams | null = null;
+  private pending: Pending[] = [];
+  private buffered = Buffer.alloc(0);
+
+  constructor(private command: string, private args: string[] = []) {}
+
+  render(
+    script: string,
+    limits: RenderLimits,
+    options: RenderOptions,
+  ): Promise<RenderResult> {
+    const path = Buffer.from(options.outputPath ?? '');
+    const body = Buffer.from(script);
+    const header = Buffer.alloc(22);
+    header.writeBigUInt64BE(BigInt(limits.memory), 0);
+    header.writeUInt32BE(limits.cpuTime, 8);
+    header.writeUInt8(options.pngProfile, 12);
+    header.writeUInt8(options.fileType, 13);
+    header.writeUInt32BE(path.length, 14);
+    header.writeUInt32BE(body.length, 18);
+
+    const daemon = this.start();
+    return new Promise((resolve, reject) => {
+      this.pending.push({ resolve, reject });
+      daemon.stdin.write(Buffer.concat([header, path, body]));
+    });
+  }
+
+  private start(): ChildProcessWithoutNullStreams {
+    if (this.process !== null) {
+      return this.process;
+    }
+
+    const daemon = spawn(this.command, [...this.args, '-D']);
+    daemon.stdout.on('data', (chunk: Buffer) => this.receive(chunk));
+    daemon.stderr.on('data', (chunk: Buffer) => process.stderr.write(chunk));
+    daemon.stdin.on('error', () => {});
+    daemon.on('close', () => this.stopped(daemon));
+    daemon.on('error', () => this.stopped(daemon));
+
+    this.process = daemon;
+    return daemon;
+  }
+
+  private receive(chunk: Buffer) {
+    this.buffered = Buffer.concat([this.buffered, chunk]);
+
+    while (this.buffered.length >= 8) {
+      const length = this.buffered.readUInt32BE(4);
+      if (this.buffered.length < 8 + length) {
+        return;
+      }
+
+      const status = this.buffered.readUInt32BE(0);
+      const data = this.buffered.subarray(8, 8 + length);
+      this.buffered = this.buffered.subarray(8 + length);
+      this.pending.shift()?.resolve({ status, data });
+    }
+  }
+
+  // jobs in flight are lost with the process, the next render starts another
+  private stopped(daemon: ChildProcessWithoutNullStreams) {
+    if (this.process !== daemon) {
+      return;
+    }
+
+    this.process = null;
+    this.buffered = Buffer.alloc(0);
+    for (const job of this.pending.splice(0)) {
+      job.reject(new Error('doodle daemon exited'));
+    }
+  }
+}
+
+// Spreads renders over several daemons, each given one script at a time, so
+// a script that runs up to its limits only holds up its own daemon. Renders
+// wait in order for the next daemon to come free.
+export class DoodlePool {
+  private idle: DoodleDaemon[];
+  private waiting: ((daemon: DoodleDaemon) => void)[] = [];
+
+  constructor(size: number, command: string, args: string[] = []) {
+    this.idle = Array.from(
+      { length: size },
+      () => new DoodleDaemon(command, args),
+    );
+  }
+
+  async render(
+    script: string,
+    limits: RenderLimits,
+    options: RenderOptions,
+  ): Promise<RenderResult> {
+    const daemon = this.idle.pop() ?? await new Promise<DoodleDaemon>(
+      (resolve) => this.waiting.push(resolve),
+    );
+    try {
+      return await daemon.render(script, limits, options);
+    } finally {
+      const next = this.waiting.shift();
+      if (next !== undefined) {
+        next(daemon);
+      } else {
+        this.idle.push(daemon);
+      }
+    }
+  }
+}
@@ -0,0 +1,133 @@
+import { createHash } from 'crypto';
+import { rename, unlink } from 'fs/promises';
+import type { RenderLimits } from './daemon';
+
+type Entry = {
+  name: string;
+  size: number;
+};
+
+export type CacheStats = {
+  hits: number;
+  misses: number;
+  entries: number;
+  bytes: number;
+};
+
+// Renders are deterministic, so a rendered file can be handed out again for
+// the same script and options. Entries are kept in least recently used order
+// and the oldest files are deleted once the cache goes over its limits.
+export class RenderCache {
+  private entries = new Map<string, Entry>();
+  private inFlight = new Map<string, Promise<Entry | null>>();
+  private bytes = 0;
+  private hits = 0;
+  private misses = 0;
+  private renders = 0;
+
+  // dir starts out empty, the cache is the only thing writing to it
+  constructor(
+    private dir: string,
+    private maxBytes: number,
+    private maxEntries: number,
+  ) {}
+
+  // the key covers everything that changes the rendered bytes
+  static key(script: string, options: Record<string, unknown>): string {
+    return createHash('sha256')
+      .update(JSON.stringify(options))
+      .update('\0')
+      .update(script)
+      .digest('hex');
+  }
+
+  // Looks up key, rendering on a miss. render writes the file at the path
+  // it's given and returns its size, or null if rendering failed, which
+  // isn't cached. Concurrent misses on a key share one render only if their
+  // limits match, since a render that breaks one caller's limits may well
+  // fit in another's.
+  async get(
+    key: string,
+    limits: RenderLimits,
+    render: (path: string) => Promise<number | null>,
+  ): Promise<string | null> {
+    const cached = this.entries.get(key);
+    if (cached !== undefined) {
+      this.hits++;
+      this.entries.delete(key);
+      this.entries.set(key, cached);
+      return cached.name;
+    }
+
+    this.misses++;
+    const flight = `${key}/${limits.memory}/${limits.cpuTime}`;
+    let pending = this.inFlight.get(flight);
+    if (pending === undefined) {
+      pending = this.fill(key, flight, render);
+      this.inFlight.set(flight, pending);
+    }
+    return (await pending)?.name ?? null;
+  }
+
+  stats(): CacheStats {
+    return {
+      hits: this.hits,
+      misses: this.misses,
+      entries: this.entries.size,
+      bytes: this.bytes,
+    };
+  }
+
+  // Renders land under a name of their own, since renders of one key under
+  // different limits may run at once and the daemon won't write over a file,
+  // and are then moved into place. Renders are deterministic, so replacing
+  // one another's file changes nothing.
+  private async fill(
+    key: string,
+    flight: string,
+    render: (path: string) => Promise<number | null>,
+  ): Promise<Entry | null> {
+    const path = `${this.dir}/${key}.${this.renders++}.part`;
+    try {
+      const size = await render(path).catch(async (error) => {
+        await unlink(path).catch(() => {});
+        throw error;
+      });
+      if (size === null) {
+        await unlink(path).catch(() => {});
+        return null;
+      }
+      await rename(path, `${this.dir}/${key}`);
+
+      const replaced = this.entries.get(key);
+      if (replaced !== undefined) {
+        this.entries.delete(key);
+        this.bytes -= replaced.size;
+      }
+      const entry = { name: key, size };
+      this.entries.set(key, entry);
+      this.bytes += size;
+      this.evict(key);
+      return entry;
+    } finally {
+      this.inFlight.delete(flight);
+    }
+  }
+
+  // Map keeps insertion order and hits are moved to the end, so the least
+  // recently used entry is always the first. The newest entry stays, since
+  // its name is about to be handed out.
+  private evict(newest: string) {
+    while (this.bytes > this.maxBytes || this.entries.size > this.maxEntries) {
+      const oldest = this.entries.keys().next();
+      if (oldest.done || oldest.value === newest) {
+        return;
+      }
+
+      const entry = this.entries.get(oldest.value)!;
+      this.entries.delete(oldest.value);
+      this.bytes -= entry.size;
+      unlink(`${this.dir}/${entry.name}`).catch(() => {});
+    }
+  }
+}
@@ -1,17 +1,89 @@
 import express from 'express';
 import * as z from 'zod';
-import { randomUUID } from 'crypto';
-import { exec } from 'child_process';
+import { existsSync, mkdtempSync, rmSync } from 'fs';
+import { availableParallelism, constants, tmpdir } from 'os';
+import { join } from 'path';
+import { DoodlePool, FileType, PngProfile, RenderStatus } from '../daemon';
+import { RenderCache } from '../renderCache';
 
 const router = express.Router();
 
+// one daemon per core, so renders run side by side as they did with a
+// process each
+const daemons = new DoodlePool(
+  availableParallelism(),
+  './build/doodle',
+  ['-C', './build/scripts'],
+);
+
+// Renders are kept in shared memory where there is some, the daemon writes
+// them there itself so images never pass through its pipe or touch the disk.
+// Each process gets a fresh directory only it can use, removed on exit.
+const renderDir = mkdtempSync(
+  join(existsSync('/dev/shm') ? '/dev/shm' : tmpdir(), 'doodle-renders-')
+);
+process.on('exit', () => {
+  rmSync(renderDir, { recursive: true, force: true });
+});
+for (const signal of ['SIGINT', 'SIGTERM'] as const) {
+  process.on(signal, () => process.exit(128 + constants.signals[signal]));
+}
+
+// at most 1 GiB or 10000 renders are kept
+const cache = new RenderCache(renderDir, 1024 * 1024 * 1024, 10000);
+
+const fileTypes = {
+  png: FileType.Png,
+  qoi: FileType.Qoi,
+  raw: FileType.Raw,
+  ppm: FileType.Ppm,
+  pam: FileType.Pam,
+};
+
+const pngProfiles = {
+  fastest: PngProfile.Fastest,
+  balanced: PngProfile.Balanced,
+  smallest: PngProfile.Smallest,
+};
+
+// memory is in bytes and cpuTime in milliseconds, profile trades PNG
+// encoding time for file size. qoi and raw skip deflate entirely, for callers
+// that decode the image straight away.
 const PostRequest = z.strictObject({
   script: z.string(),
   memory: z.int().positive(),
-  cpuTime: z.int().positive(),
+  cpuTime: z.int().positive().max(0xffffffff),
+  format: z.enum(['png', 'qoi', 'raw', 'ppm', 'pam']).default('png'),
+  profile: z.enum(['fastest', 'balanced', 'smallest']).default('balanced'),
 });
 
-router.post('/', (req, res) => {
+class RenderError extends Error {
+  constructor(public status: RenderStatus, message: string) {
+    super(message);
+  }
+}
+
+// the script's own faults are client errors, a broken limit is reported as
+// such and anything else is on the server
+function errorResponse(status: RenderStatus): [number, string] {
+  switch (status) {
+    case RenderStatus.MemoryLimit:
+    case RenderStatus.DrawLimit:
+    case RenderStatus.PixelLimit:
+      return [422, 'Doodle went over its memory limit'];
+    case RenderStatus.TimeLimit:
+      return [422, 'Doodle went over its cpu time limit'];
+    case RenderStatus.UnsetGlobal:
+    case RenderStatus.BadGlobalType:
+    case RenderStatus.LoadFail:
+    case RenderStatus.RunFail:
+      return [400, 'Failed to create image'];
+    default:
+      return [500, 'Failed to create image'];
+  }
+}
+
+router.post('/', async (req, res) => {
   const result = PostRequest.safeParse(req.body)
   if (!result.success) {
     res.status(400);
@@ -22,22 +94,75 @@ router.post('/', (req, res) => {
     return;
   }
 
-  const renderName = randomUUID();
-
-  const doodle = exec(`./build/doodle >./build/renders/${renderName}`, (error) => {
-    if (error) {
-      res.status(400);
-      res.json({ message: 'Failed to create image' });
-    } else {
-      res.status(201);
-      res.json({
-        message: 'Doodle created',
-        name: renderName,
-      });
-    }
+  // the profile only changes PNGs, the format is kept in the name so the
+  // render is served as the right type
+  const key = RenderCache.key(result.data.script, {
+    format: result.data.format,
+    profile: result.data.format === 'png' ? result.data.profile : undefined,
+  }) + '.' + result.data.format;
+
+  const limits = { memory: result.data.memory, cpuTime: result.data.cpuTime };
+  let renderName: string | null;
+  try {
+    renderName = await cache.get(key, limits, async (path) => {
+      const render = await daemons.render(
+        result.data.script,
+        limits,
+        {
+          pngProfile: pngProfiles[result.data.profile],
+          fileType: fileTypes[result.data.format],
+          outputPath: path,
+        },
+      );
+      if (render.status !== RenderStatus.Ok) {
+        throw new RenderError(render.status, render.data.toString());
+      }
+
+      return Number(render.data.readBigUInt64BE(0));
+    });
+  } catch (error) {
+    const [status, message] = errorResponse(
+      error instanceof RenderError ? error.status : RenderStatus.InitFail
+    );
+    res.status(status);
+    res.json({
+      message,
+      error: error instanceof RenderError ? error.message : undefined,
+    });
+    return;
+  }
+
+  if (renderName === null) {
+    res.status(500);
+    res.json({ message: 'Failed to create image' });
+    return;
+  }
+
+  res.status(201);
+  res.json({
+    message: 'Doodle created',
+    name: renderName,
   });
-  doodle.stdin?.write(result.data.script);
-  doodle.stdin?.end();
 })
 
+router.get('/cache', (_req, res) => {
+  res.json(cache.stats());
+});
+
+// streams a render straight from its file
+router.get('/:name', (req, res) => {
+  if (!/^[0-9a-f]{64}\.[a-z]+$/.test(req.params.name)) {
+    res.status(404);
+    res.json({ message: 'No such doodle' });
+    return;
+  }
+
+  res.sendFile(req.params.name, { root: renderDir }, (error) => {
+    if (error !== undefined && !res.headersSent) {
+      res.status(404);
+      res.json({ message: 'No such doodle' });
+    }
+  });
+});
+
 export default router;
@@ -0,0 +1,24 @@
+#ifndef DOODLE_BYTES_H
+#define DOODLE_BYTES_H
+
+#include <stdint.h>
+
+// a pixel's r, g, b and a bytes
+#define PIXEL_SIZE 4
+
+// Images hold each pixel's transparency in a, 0 for opaque, so draws can be
+// packed without touching it, but every format written wants opacity. Alpha
+// is flipped on the way out.
+static inline uint8_t opacity(uint8_t transparency) {
+    return 0xff - transparency;
+}
+
+// writes n big endian, the byte order of every header written
+static inline void put_u32(uint8_t *p, uint32_t n) {
+    p[0] = n >> 24;
+    p[1] = n >> 16;
+    p[2] = n >> 8;
+    p[3] = n;
+}
+
+#endif
@@ -1,13 +1,28 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 
 #include <png.h>
 
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "bytes.h"
 #include "doodle.h"
+#include "png_layout.h"
+#include "png_parallel.h"
+#include "qoi.h"
+#include "scale.h"
+#include "workers.h"
 
 #ifndef M_PI
 #define M_PI 3.1415926535897932384626433832
@@ -15,98 +30,880 @@
 
 #define DIFF(a, b) fmax(fdim((a), (b)), fdim((b), (a)))
 
-#define PIXEL_SIZE 4
+// half thickness below which a line is drawn pixel by pixel
+#define HAIRLINE 0.5
+
+// converted rows are gathered into writes of about this many bytes
+#define EXPORT_BUFFER_SIZE (256 * 1024)
 
+// A band holds only rows [y0, y0 + rows) of the image, room permitting for
+// capacity of them, a whole image holds every row.
 struct doodle_image {
     uint32_t width, height;
+    uint32_t y0, rows;
+    uint32_t capacity;
+    doodle_palette palette;
     uint8_t pixels[];
 };
 
-static void copy_color(uint8_t *dst, doodle_color c) {
-    *dst++ = c.r;
-    *dst++ = c.g;
-    *dst++ = c.b;
-    *dst = c.a;
+// a bit per pixel, each row starts on a fresh word
+struct doodle_coverage {
+    uint32_t width, height;
+    size_t row_words;
+    uint64_t bits[];
+};
+
+// where spans end up, pixels already marked in coverage are left alone. Draws
+// are bounded by a width x height canvas, of which img holds the pixels from
+// (x0, y0) on.
+typedef struct {
+    doodle_image *img;
+    doodle_coverage *coverage;
+    uint32_t width, height;
+    int64_t x0, y0;
+} raster;
+
+static raster image_raster(doodle_image *img, doodle_coverage *cov) {
+    return (raster) {
+        .img = img,
+        .coverage = cov,
+        .width = img->width,
+        .height = img->height,
+    };
+}
+
+static uint32_t pack_color(doodle_color c) {
+    uint32_t packed;
+    memcpy(&packed, &c, sizeof packed);
+    return packed;
+}
+
+#define PALETTE_SLOTS (2 * DOODLE_PALETTE_SIZE)
+
+static uint32_t palette_slot(uint32_t packed) {
+    return (packed * UINT32_C(2654435761)) % PALETTE_SLOTS;
+}
+
+void doodle_palette_clear(doodle_palette *p) {
+    p->count = 0;
+    p->overflow = false;
+    p->translucent = false;
+    memset(p->slots, 0, sizeof p->slots);
+}
+
+int doodle_palette_find(const doodle_palette *p, doodle_color c) {
+    uint32_t packed = pack_color(c);
+    // at most half the slots are used, so there's always an empty one
+    for (uint32_t i = palette_slot(packed); p->slots[i] != 0;
+        i = (i + 1) % PALETTE_SLOTS
+    ) {
+        if (pack_color(p->colors[p->slots[i] - 1]) == packed) {
+            return p->slots[i] - 1;
+        }
+    }
+    return -1;
+}
+
+void doodle_palette_add(doodle_palette *p, doodle_color c) {
+    p->translucent = p->translucent || c.a != 0;
+    if (p->overflow || doodle_palette_find(p, c) >= 0) {
+        return;
+    }
+    if (p->count == DOODLE_PALETTE_SIZE) {
+        p->overflow = true;
+        return;
+    }
+
+    uint32_t i = palette_slot(pack_color(c));
+    while (p->slots[i] != 0) {
+        i = (i + 1) % PALETTE_SLOTS;
+    }
+    p->colors[p->count++] = c;
+    p->slots[i] = p->count;
+}
+
+void doodle_palette_merge(doodle_palette *p, const doodle_palette *from) {
+    for (uint32_t i = 0; i < from->count; i++) {
+        doodle_palette_add(p, from->colors[i]);
+    }
+    p->overflow = p->overflow || from->overflow;
+    p->translucent = p->translucent || from->translucent;
+}
+
+doodle_color doodle_draw_color(const doodle_draw *d) {
+    switch (d->type) {
+    case DOODLE_DRAW_RECT: return d->params.rect.color;
+    case DOODLE_DRAW_CIRCLE: return d->params.circle.color;
+    case DOODLE_DRAW_LINE: return d->params.line.color;
+    }
+    return (doodle_color) { 0 };
+}
+
+static uint32_t *pixel_row(doodle_image *img, uint32_t y) {
+    return (uint32_t *)(
+        img->pixels + (size_t)img->width * (y - img->y0) * PIXEL_SIZE
+    );
+}
+
+static doodle_region full_region(doodle_image *img) {
+    return doodle_image_region(img);
+}
+
+// bits [lo, hi) of a coverage word, 0 <= lo < hi <= 64
+static uint64_t word_mask(uint32_t lo, uint32_t hi) {
+    return (~(uint64_t)0 << lo) & (~(uint64_t)0 >> (64 - hi));
+}
+
+static uint64_t *coverage_row(doodle_coverage *cov, uint32_t y) {
+    return cov->bits + cov->row_words * y;
+}
+
+// true when every pixel of r has already been covered
+static bool region_covered(doodle_coverage *cov, const doodle_region *r) {
+    for (uint32_t y = r->y0; y < r->y1; y++) {
+        uint64_t *bits = coverage_row(cov, y);
+        for (uint32_t x = r->x0; x < r->x1;) {
+            uint32_t w = x / 64;
+            uint32_t end = (w + 1) * 64 < r->x1 ? (w + 1) * 64 : r->x1;
+            uint64_t mask = word_mask(x % 64, end - w * 64);
+            if ((bits[w] & mask) != mask) return false;
+            x = end;
+        }
+    }
+    return true;
+}
+
+// writes the pixels of [x0, x1) not yet covered, and marks them covered
+static void fill_uncovered(
+    uint32_t *row, 
+    uint64_t *bits, 
+    int64_t x0, 
+    int64_t x1, 
+    uint32_t packed
+) {
+    for (int64_t x = x0; x < x1;) {
+        int64_t w = x / 64;
+        int64_t end = (w + 1) * 64 < x1 ? (w + 1) * 64 : x1;
+        uint64_t mask = word_mask(x % 64, end - w * 64);
+        uint64_t todo = mask & ~bits[w];
+        bits[w] |= mask;
+
+        if (todo == mask) {
+            for (int64_t i = x; i < end; i++) {
+                row[i] = packed;
+            }
+        } else {
+            for (; todo != 0; todo &= todo - 1) {
+                row[w * 64 + __builtin_ctzll(todo)] = packed;
+            }
+        }
+        x = end;
+    }
 }
 
-static void set_pixel(doodle_image *img, uint32_t x, uint32_t y, doodle_color c) {
-    copy_color(img->pixels + img->width * y * PIXEL_SIZE + x * PIXEL_SIZE, c);
+// The shared raster kernel, every primitive is broken down into horizontal 
+// [x0, x1) spans which are clipped to the region being drawn and written here.
+static void fill_span(
+    const raster *r, 
+    const doodle_region *clip,
+    int64_t y, 
+    int64_t x0, 
+    int64_t x1, 
+    uint32_t packed
+) {
+    if (y < clip->y0 || y >= clip->y1) return;
+    if (x0 < clip->x0) x0 = clip->x0;
+    if (x1 > clip->x1) x1 = clip->x1;
+
+    // only whole images are drawn beneath coverage
+    uint32_t *row = pixel_row(r->img, y - r->y0);
+    if (r->coverage != NULL) {
+        fill_uncovered(row, coverage_row(r->coverage, y), x0, x1, packed);
+        return;
+    }
+
+    for (int64_t x = x0; x < x1; x++) {
+        row[x - r->x0] = packed;
+    }
+}
+
+// narrows b to the part inside clip, false if nothing is left to draw there
+static bool clip_bounds(
+    const raster *r, 
+    doodle_region *b, 
+    const doodle_region *clip
+) {
+    if (b->x0 < clip->x0) b->x0 = clip->x0;
+    if (b->y0 < clip->y0) b->y0 = clip->y0;
+    if (b->x1 > clip->x1) b->x1 = clip->x1;
+    if (b->y1 > clip->y1) b->y1 = clip->y1;
+    if (b->x0 >= b->x1 || b->y0 >= b->y1) return false;
+
+    return r->coverage == NULL || !region_covered(r->coverage, b);
 }
 
 doodle_image *doodle_new(doodle_config *conf) {
+    return doodle_renew(NULL, conf);
+}
+
+size_t doodle_size(const doodle_config *conf) {
     size_t pixel_count = (size_t)conf->width * conf->height;
+    if (pixel_count > (SIZE_MAX - sizeof(doodle_image)) / PIXEL_SIZE) {
+        return SIZE_MAX;
+    }
+    return pixel_count * PIXEL_SIZE + sizeof(doodle_image);
+}
+
+doodle_region doodle_image_region(const doodle_image *img) {
+    return (doodle_region) {
+        .x0 = 0,
+        .y0 = img->y0,
+        .x1 = img->width,
+        .y1 = img->y0 + img->rows
+    };
+}
+
+static void clear(doodle_image *img, doodle_color background) {
+    raster r = image_raster(img, NULL);
+    doodle_region clip = full_region(img);
+    uint32_t packed = pack_color(background);
+    for (uint32_t y = clip.y0; y < clip.y1; y++) {
+        fill_span(&r, &clip, y, 0, img->width, packed);
+    }
+}
+
+doodle_image *doodle_renew(doodle_image *img, doodle_config *conf) {
+    size_t size = doodle_size(conf);
+    if (size == SIZE_MAX) {
+        return NULL;
+    }
 
-    doodle_image *img = malloc(pixel_count * PIXEL_SIZE + sizeof *img);
+    img = realloc(img, size);
     if (img == NULL) {
         return NULL;
     }
 
     img->width = conf->width;
     img->height = conf->height;
+    img->y0 = 0;
+    img->rows = conf->height;
+    img->capacity = conf->height;
+    doodle_palette_clear(&img->palette);
+    doodle_palette_add(&img->palette, conf->background);
+    clear(img, conf->background);
+
+    return img;
+}
 
-    for (size_t i = 0; i < pixel_count; i++) {
-        copy_color(img->pixels + i * PIXEL_SIZE, conf->background);
+const doodle_palette *doodle_image_palette(const doodle_image *img) {
+    return &img->palette;
+}
+
+void doodle_image_add_colors(doodle_image *img, const doodle_palette *p) {
+    doodle_palette_merge(&img->palette, p);
+}
+
+doodle_image *doodle_downscale(
+    const doodle_image *img, 
+    uint32_t width, 
+    uint32_t height
+) {
+    if (img->rows != img->height || width == 0 || height == 0
+        || width > img->width || height > img->height
+    ) {
+        return NULL;
     }
 
-    return img;
+    doodle_config conf = { .width = width, .height = height };
+    size_t size = doodle_size(&conf);
+    if (size == SIZE_MAX) {
+        return NULL;
+    }
+    doodle_image *small = malloc(size);
+    if (small == NULL) {
+        return NULL;
+    }
+
+    small->width = width;
+    small->height = height;
+    small->y0 = 0;
+    small->rows = height;
+    small->capacity = height;
+    // averaging makes new colours, but none more translucent than before
+    doodle_palette_clear(&small->palette);
+    small->palette.overflow = true;
+    small->palette.translucent = img->palette.translucent;
+
+    if (!doodle_scale_down(
+            small->pixels, width, height, 
+            img->pixels, img->width, img->height
+        )
+    ) {
+        free(small);
+        return NULL;
+    }
+    return small;
 }
 
-void doodle_draw_rect(
-    doodle_image *img, 
-    doodle_point orig, 
+size_t doodle_band_size(const doodle_config *conf, uint32_t rows) {
+    doodle_config band = *conf;
+    band.height = rows < conf->height ? rows : conf->height;
+    return doodle_size(&band);
+}
+
+doodle_image *doodle_band_new(const doodle_config *conf, uint32_t rows) {
+    if (rows > conf->height) {
+        rows = conf->height;
+    }
+    size_t size = doodle_band_size(conf, rows);
+    if (size == SIZE_MAX) {
+        return NULL;
+    }
+
+    doodle_image *band = malloc(size);
+    if (band == NULL) {
+        return NULL;
+    }
+
+    band->width = conf->width;
+    band->height = conf->height;
+    band->y0 = 0;
+    band->rows = 0;
+    band->capacity = rows;
+    doodle_palette_clear(&band->palette);
+    doodle_palette_add(&band->palette, conf->background);
+    return band;
+}
+
+void doodle_band_move(
+    doodle_image *band, 
+    const doodle_config *conf, 
+    uint32_t y0
+) {
+    band->y0 = y0 < band->height ? y0 : band->height;
+    band->rows = band->height - band->y0 < band->capacity 
+        ? band->height - band->y0 
+        : band->capacity;
+    clear(band, conf->background);
+}
+
+static bool rect_bounds(
+    const doodle_rect_draw *r, 
     uint32_t width, 
-    uint32_t height,
-    doodle_color color
+    uint32_t height, 
+    doodle_region *b
 ) {
+    doodle_point orig = r->origin;
+    uint32_t w = r->width;
+    uint32_t h = r->height;
+
     if (orig.x < 0) {
         uint32_t move = -orig.x;
-        width = width > move ? width - move : 0;
+        w = w > move ? w - move : 0;
         orig.x = 0;
     }
     if (orig.y < 0) {
         uint32_t move = -orig.y;
-        height = height > move ? height - move : 0;
+        h = h > move ? h - move : 0;
         orig.y = 0;
     }
 
-    for (uint32_t x = orig.x; x < img->width && x - orig.x <= width; x++) {
-        for (uint32_t y = orig.y; y < img->height && y - orig.y <= height; y++) {
-            set_pixel(img, x, y, color);
+    // the far edge is inclusive
+    b->x0 = fmin(orig.x, width);
+    b->y0 = fmin(orig.y, height);
+    b->x1 = fmin(floor(orig.x + w) + 1, width);
+    b->y1 = fmin(floor(orig.y + h) + 1, height);
+
+    return b->x0 < b->x1 && b->y0 < b->y1;
+}
+
+static void draw_rect(
+    const raster *r, 
+    const doodle_region *clip,
+    const doodle_rect_draw *rect
+) {
+    doodle_region b;
+    if (!rect_bounds(rect, r->width, r->height, &b)) return;
+    if (!clip_bounds(r, &b, clip)) return;
+
+    uint32_t packed = pack_color(rect->color);
+    for (uint32_t y = b.y0; y < b.y1; y++) {
+        fill_span(r, &b, y, b.x0, b.x1, packed);
+    }
+}
+
+typedef bool (*coverage_rule)(const void *shape, int64_t x, int64_t y);
+
+// Fills the analytic span [lo, hi] of row y after settling its ends against
+// the shape's exact per-pixel rule, so rounding in the span solution can 
+// never change which pixels are covered. Shapes thin enough for that rule to
+// leave gaps inside the span ask for every inner pixel to be tested as well.
+// [min_x, max_x] must lie within clip.
+static void fill_settled_span(
+    const raster *r,
+    const doodle_region *clip,
+    int64_t y,
+    double lo,
+    double hi,
+    int64_t min_x,
+    int64_t max_x,
+    coverage_rule covers,
+    const void *shape,
+    bool test_inner,
+    uint32_t packed
+) {
+    lo = fmax(lo, min_x);
+    hi = fmin(hi, max_x);
+    if (!(lo <= hi)) return;
+
+    int64_t x0 = ceil(lo);
+    int64_t x1 = floor(hi);
+
+    while (x0 <= x1 && !covers(shape, x0, y)) x0++;
+    while (x1 >= x0 && !covers(shape, x1, y)) x1--;
+    if (x0 > x1) return;
+
+    while (x0 > min_x && covers(shape, x0 - 1, y)) x0--;
+    while (x1 < max_x && covers(shape, x1 + 1, y)) x1++;
+
+    if (!test_inner) {
+        fill_span(r, clip, y, x0, x1 + 1, packed);
+        return;
+    }
+
+    int64_t run = x0;
+    for (int64_t x = x0 + 1; x <= x1; x++) {
+        if (!covers(shape, x, y)) {
+            if (run >= 0) fill_span(r, clip, y, run, x, packed);
+            run = -1;
+        } else if (run < 0) {
+            run = x;
         }
     }
+    fill_span(r, clip, y, run, x1 + 1, packed);
 }
 
-void doodle_draw_circle(
-    doodle_image *img,
-    doodle_point orig,
-    uint32_t radius,
-    doodle_color color
+typedef struct {
+    doodle_point orig;
+    double drad;
+} circle_shape;
+
+static bool in_circle(const void *shape, int64_t x, int64_t y) {
+    const circle_shape *c = shape;
+    return hypot(DIFF(x, c->orig.x), DIFF(y, c->orig.y)) < c->drad + 0.5;
+}
+
+static bool circle_bounds(
+    const doodle_circle_draw *c,
+    uint32_t width,
+    uint32_t height,
+    doodle_region *b
 ) {
-    double drad = radius;
+    doodle_point orig = c->origin;
+    double drad = c->radius;
+
+    if (width == 0 || height == 0) return false;
 
     // if circle doesn't overlap with image do nothing
-    if (orig.x < 0 && orig.x + drad < 0) return;
-    if (orig.y < 0 && orig.y + drad < 0) return;
-    if (orig.y > 0 && orig.y - drad >= (int64_t)img->height) return;
-    if (orig.x > 0 && orig.x - drad >= (int64_t)img->width) return;
+    if (orig.x < 0 && orig.x + drad < 0) return false;
+    if (orig.y < 0 && orig.y + drad < 0) return false;
+    if (orig.y > 0 && orig.y - drad >= (int64_t)height) return false;
+    if (orig.x > 0 && orig.x - drad >= (int64_t)width) return false;
 
     // don't start before image
-    uint32_t startx = orig.x > 0 && orig.x > drad ? (double)orig.x - radius : 0;
-    uint32_t starty = orig.y > 0 && orig.y > drad ? (double)orig.y - radius : 0;
+    b->x0 = orig.x > 0 && orig.x > drad ? orig.x - drad : 0;
+    b->y0 = orig.y > 0 && orig.y > drad ? orig.y - drad : 0;
 
     // don't go past end of image
-    uint32_t endx = (double)orig.x + drad + 1;
-    uint32_t endy = (double)orig.y + drad + 1;
-    endx = endx < img->width ? endx : img->width - 1;
-    endy = endy < img->height ? endy : img->height - 1;
-
-    for (uint32_t x = startx; x <= endx; x++) {
-        for (uint32_t y = starty; y <= endy; y++) {
-            if (hypot(DIFF(x, orig.x), DIFF(y, orig.y)) < drad + 0.5) {
-                set_pixel(img, x, y, color);
-            }
+    b->x1 = (uint32_t)fmin(orig.x + drad + 1, width - 1.0) + 1;
+    b->y1 = (uint32_t)fmin(orig.y + drad + 1, height - 1.0) + 1;
+
+    return b->x0 < b->x1 && b->y0 < b->y1;
+}
+
+static void draw_circle(
+    const raster *r,
+    const doodle_region *clip,
+    const doodle_circle_draw *c
+) {
+    doodle_region b;
+    if (!circle_bounds(c, r->width, r->height, &b)) return;
+    if (!clip_bounds(r, &b, clip)) return;
+
+    doodle_point orig = c->origin;
+    circle_shape shape = { .orig = orig, .drad = c->radius };
+    double outer = shape.drad + 0.5;
+
+    uint32_t packed = pack_color(c->color);
+    for (uint32_t y = b.y0; y < b.y1; y++) {
+        double dy = DIFF(y, orig.y);
+        if (dy >= outer) continue;
+
+        double half = sqrt(outer * outer - dy * dy);
+        fill_settled_span(
+            r, &b, y, 
+            orig.x - half, orig.x + half, 
+            b.x0, (int64_t)b.x1 - 1, 
+            in_circle, &shape, false, packed
+        );
+    }
+}
+
+typedef struct {
+    doodle_point p1;
+    doodle_point p2;
+    double dx, dy;
+    double length;
+    double half_thickness;
+} line_shape;
+
+static bool in_line(const void *shape, int64_t x, int64_t y) {
+    const line_shape *l = shape;
+
+    // Calculate distance from point to line
+    double px = x - l->p1.x;
+    double py = y - l->p1.y;
+    
+    double dot = px * l->dx + py * l->dy;
+    double proj_x, proj_y;
+    
+    if (dot <= 0) {
+        // Before start point
+        proj_x = l->p1.x;
+        proj_y = l->p1.y;
+    } else if (dot >= l->length * l->length) {
+        // After end point  
+        proj_x = l->p2.x;
+        proj_y = l->p2.y;
+    } else {
+        // Project onto line
+        double t = dot / (l->length * l->length);
+        proj_x = l->p1.x + t * l->dx;
+        proj_y = l->p1.y + t * l->dy;
+    }
+    
+    double dist = sqrt(
+        (x - proj_x) * (x - proj_x)
+      + (y - proj_y) * (y - proj_y)
+    );
+
+    return dist <= l->half_thickness;
+}
+
+// widens [*lo, *hi] to cover the chord of the end cap centred on p at row y
+static void cap_chord(
+    doodle_point p, 
+    double radius, 
+    double y, 
+    double *lo, 
+    double *hi
+) {
+    double ry = y - p.y;
+    if (fabs(ry) > radius) return;
+
+    double half = sqrt(radius * radius - ry * ry);
+    *lo = fmin(*lo, p.x - half);
+    *hi = fmax(*hi, p.x + half);
+}
+
+// narrows [*lo, *hi] to the x values where a * x + b lies within [min, max]
+static void clamp_linear(
+    double a, 
+    double b, 
+    double min, 
+    double max, 
+    double *lo, 
+    double *hi
+) {
+    if (a == 0) {
+        if (b < min || b > max) {
+            *lo = INFINITY;
+            *hi = -INFINITY;
         }
+        return;
+    }
+
+    double x0 = (min - b) / a;
+    double x1 = (max - b) / a;
+    *lo = fmax(*lo, fmin(x0, x1));
+    *hi = fmin(*hi, fmax(x0, x1));
+}
+
+// The horizontal interval of the thick segment (a capsule) on row y is the 
+// union of the two end cap chords and the body of the segment.
+static void line_row_extent(
+    const line_shape *l, 
+    double y, 
+    double *lo, 
+    double *hi
+) {
+    double ry = y - l->p1.y;
+    double len2 = l->length * l->length;
+    double reach = l->half_thickness * l->length;
+
+    // body: projection falls within the segment and the perpendicular 
+    // distance is within half the thickness
+    double body_lo = -INFINITY;
+    double body_hi = INFINITY;
+    clamp_linear(
+        l->dx, ry * l->dy - l->p1.x * l->dx, 
+        0, len2, 
+        &body_lo, &body_hi
+    );
+    clamp_linear(
+        l->dy, -ry * l->dx - l->p1.x * l->dy, 
+        -reach, reach, 
+        &body_lo, &body_hi
+    );
+
+    *lo = body_lo;
+    *hi = body_hi;
+    if (!(*lo <= *hi)) {
+        *lo = INFINITY;
+        *hi = -INFINITY;
+    }
+
+    cap_chord(l->p1, l->half_thickness, y, lo, hi);
+    cap_chord(l->p2, l->half_thickness, y, lo, hi);
+}
+
+static bool line_bounds(
+    const doodle_line_draw *l,
+    uint32_t width,
+    uint32_t height,
+    doodle_region *b
+) {
+    doodle_point p1 = l->p1;
+    doodle_point p2 = l->p2;
+    double thickness = l->thickness;
+
+    if (hypot(p2.x - p1.x, p2.y - p1.y) < 1e-10) return false;
+
+    b->x0 = fmin(width, fmax(0, fmin(p1.x, p2.x) - thickness));
+    b->y0 = fmin(height, fmax(0, fmin(p1.y, p2.y) - thickness));
+    b->x1 = fmax(0, fmin(width, fmax(p1.x, p2.x) + thickness + 1));
+    b->y1 = fmax(0, fmin(height, fmax(p1.y, p2.y) + thickness + 1));
+
+    return b->x0 < b->x1 && b->y0 < b->y1;
+}
+
+static void draw_line(
+    const raster *r,
+    const doodle_region *clip,
+    const doodle_line_draw *l
+) {
+    doodle_region b;
+    if (!line_bounds(l, r->width, r->height, &b)) return;
+    if (!clip_bounds(r, &b, clip)) return;
+
+    double dx = l->p2.x - l->p1.x;
+    double dy = l->p2.y - l->p1.y;
+
+    line_shape shape = {
+        .p1 = l->p1,
+        .p2 = l->p2,
+        .dx = dx,
+        .dy = dy,
+        .length = hypot(dx, dy),
+        .half_thickness = l->thickness / 2.0,
+    };
+
+    bool hairline = shape.half_thickness < HAIRLINE;
+
+    uint32_t packed = pack_color(l->color);
+    for (uint32_t y = b.y0; y < b.y1; y++) {
+        double lo, hi;
+        line_row_extent(&shape, y, &lo, &hi);
+        fill_settled_span(
+            r, &b, y, 
+            lo, hi, 
+            b.x0, (int64_t)b.x1 - 1, 
+            in_line, &shape, hairline, packed
+        );
+    }
+}
+
+bool doodle_draw_bounds(
+    const doodle_draw *d,
+    uint32_t width,
+    uint32_t height,
+    doodle_region *bounds
+) {
+    switch (d->type) {
+    case DOODLE_DRAW_RECT: 
+        return rect_bounds(&d->params.rect, width, height, bounds);
+    case DOODLE_DRAW_CIRCLE: 
+        return circle_bounds(&d->params.circle, width, height, bounds);
+    case DOODLE_DRAW_LINE: 
+        return line_bounds(&d->params.line, width, height, bounds);
     }
+    return false;
+}
+
+// A line's bounding box can be far wider than the line is over a few rows, 
+// so it's narrowed to the part of the segment within reach of the rows.
+static bool line_band_bounds(
+    const doodle_line_draw *l,
+    uint32_t y0,
+    uint32_t y1,
+    doodle_region *b
+) {
+    doodle_point p1 = l->p1;
+    doodle_point p2 = l->p2;
+    double dy = p2.y - p1.y;
+    double reach = fabs(l->thickness) + 1;
+
+    double t0 = 0;
+    double t1 = 1;
+    if (dy != 0) {
+        double ta = (y0 - reach - p1.y) / dy;
+        double tb = (y1 + reach - p1.y) / dy;
+        t0 = fmax(t0, fmin(ta, tb));
+        t1 = fmin(t1, fmax(ta, tb));
+        if (!(t0 <= t1)) return false;
+    }
+
+    double xa = p1.x + t0 * (p2.x - p1.x);
+    double xb = p1.x + t1 * (p2.x - p1.x);
+    double x0 = fmin(xa, xb) - reach;
+    double x1 = fmax(xa, xb) + reach + 1;
+
+    if (x0 > b->x0) b->x0 = fmin(x0, b->x1);
+    if (x1 < b->x1) b->x1 = fmax(x1, b->x0);
+
+    return b->x0 < b->x1;
+}
+
+bool doodle_draw_band_bounds(
+    const doodle_draw *d,
+    uint32_t width,
+    uint32_t height,
+    uint32_t y0,
+    uint32_t y1,
+    doodle_region *bounds
+) {
+    if (!doodle_draw_bounds(d, width, height, bounds)) return false;
+
+    if (bounds->y0 < y0) bounds->y0 = y0;
+    if (bounds->y1 > y1) bounds->y1 = y1;
+    if (bounds->y0 >= bounds->y1) return false;
+
+    if (d->type == DOODLE_DRAW_LINE) {
+        return line_band_bounds(
+            &d->params.line, bounds->y0, bounds->y1, bounds
+        );
+    }
+    return true;
+}
+
+static void draw(const raster *r, const doodle_draw *d, doodle_region clip) {
+    switch (d->type) {
+    case DOODLE_DRAW_RECT: 
+        draw_rect(r, &clip, &d->params.rect); 
+        break;
+    case DOODLE_DRAW_CIRCLE: 
+        draw_circle(r, &clip, &d->params.circle); 
+        break;
+    case DOODLE_DRAW_LINE: 
+        draw_line(r, &clip, &d->params.line); 
+        break;
+    }
+}
+
+void doodle_draw_clipped(
+    doodle_image *img, 
+    const doodle_draw *d, 
+    doodle_region clip
+) {
+    raster r = image_raster(img, NULL);
+    draw(&r, d, clip);
+}
+
+void doodle_draw_window(
+    doodle_image *img, 
+    const doodle_draw *d, 
+    uint32_t width, 
+    uint32_t height, 
+    int64_t x0, 
+    int64_t y0, 
+    doodle_region clip
+) {
+    raster r = { 
+        .img = img, 
+        .width = width, 
+        .height = height, 
+        .x0 = x0, 
+        .y0 = y0,
+    };
+    draw(&r, d, clip);
+}
+
+void doodle_draw_beneath(
+    doodle_image *img, 
+    const doodle_draw *d, 
+    doodle_region clip,
+    doodle_coverage *cov
+) {
+    raster r = image_raster(img, cov);
+    draw(&r, d, clip);
+}
+
+doodle_coverage *doodle_coverage_new(uint32_t width, uint32_t height) {
+    size_t row_words = (width + 63) / 64;
+
+    doodle_coverage *cov = calloc(1, doodle_coverage_size(width, height));
+    if (cov == NULL) {
+        return NULL;
+    }
+
+    cov->width = width;
+    cov->height = height;
+    cov->row_words = row_words;
+
+    return cov;
+}
+
+size_t doodle_coverage_size(uint32_t width, uint32_t height) {
+    size_t row_words = (width + 63) / 64;
+    return sizeof(doodle_coverage) + row_words * height * sizeof(uint64_t);
+}
+
+void doodle_draw_rect(
+    doodle_image *img, 
+    doodle_point orig, 
+    uint32_t width, 
+    uint32_t height,
+    doodle_color color
+) {
+    doodle_draw d = {
+        .type = DOODLE_DRAW_RECT,
+        .params.rect = {
+            .origin = orig,
+            .width = width,
+            .height = height,
+            .color = color,
+        },
+    };
+    doodle_palette_add(&img->palette, color);
+    doodle_draw_clipped(img, &d, full_region(img));
+}
+
+void doodle_draw_circle(
+    doodle_image *img,
+    doodle_point orig,
+    uint32_t radius,
+    doodle_color color
+) {
+    doodle_draw d = {
+        .type = DOODLE_DRAW_CIRCLE,
+        .params.circle = {
+            .origin = orig,
+            .radius = radius,
+            .color = color,
+        },
+    };
+    doodle_palette_add(&img->palette, color);
+    doodle_draw_clipped(img, &d, full_region(img));
 }
 
 void doodle_draw_line(
@@ -116,123 +913,493 @@ void doodle_draw_line(
     double thickness,
     doodle_color color
 ) {
-    double dx = p2.x - p1.x;
-    double dy = p2.y - p1.y;
-    double length = hypot(dx, dy);
-    
-    if (length < 1e-10) return;
-    
-    double half_thickness = thickness / 2.0;
-    
-    uint32_t startx = fmax(0, fmin(p1.x, p2.x) - thickness);
-    uint32_t starty = fmax(0, fmin(p1.y, p2.y) - thickness);
-    uint32_t endx = fmin(img->width, fmax(p1.x, p2.x) + thickness + 1);
-    uint32_t endy = fmin(img->height, fmax(p1.y, p2.y) + thickness + 1);
-
-    for (uint32_t x = startx; x < endx; x++) {
-        for (uint32_t y = starty; y < endy; y++) {
-            // Calculate distance from point to line
-            double px = x - p1.x;
-            double py = y - p1.y;
-            
-            double dot = px * dx + py * dy;
-            double proj_x, proj_y;
-            
-            if (dot <= 0) {
-                // Before start point
-                proj_x = p1.x;
-                proj_y = p1.y;
-            } else if (dot >= length * length) {
-                // After end point  
-                proj_x = p2.x;
-                proj_y = p2.y;
-            } else {
-                // Project onto line
-                double t = dot / (length * length);
-                proj_x = p1.x + t * dx;
-                proj_y = p1.y + t * dy;
-            }
-            
-            double dist = sqrt(
-                (x - proj_x) * (x - proj_x)
-              + (y - proj_y) * (y - proj_y)
-            );
-            
-            if (dist <= half_thickness) {
-                set_pixel(img, x, y, color);
-            }
-        }
-    }
+    doodle_draw d = {
+        .type = DOODLE_DRAW_LINE,
+        .params.line = {
+            .p1 = p1,
+            .p2 = p2,
+            .thickness = thickness,
+            .color = color,
+        },
+    };
+    doodle_palette_add(&img->palette, color);
+    doodle_draw_clipped(img, &d, full_region(img));
 }
 
 bool doodle_export(doodle_image *img, doodle_config *conf, FILE *out) {
     switch (conf->ft) {
     case DOODLE_FT_PPM: return doodle_export_ppm(img, out);
-    case DOODLE_FT_PNG: return doodle_export_png(img, out);
+    case DOODLE_FT_PNG: return doodle_export_png(img, conf, out);
+    case DOODLE_FT_PAM: return doodle_export_pam(img, out);
+    case DOODLE_FT_RAW: return doodle_export_raw(img, out);
+    case DOODLE_FT_QOI: return doodle_export_qoi(img, out);
     }
+    return false;
 }
 
-bool doodle_export_ppm(doodle_image *img, FILE *out) {
-    if (fprintf(
-            out, "P6\n%"PRId32" %"PRId32"\n255\n", 
-            img->width, img->height
-        ) < 0
-    ) {
+typedef void (*row_converter)(uint8_t *dst, const uint8_t *src, uint32_t width);
+
+static void rgba_to_rgb(uint8_t *dst, const uint8_t *src, uint32_t width) {
+    uint32_t x = 0;
+#ifdef __SSSE3__
+    // four pixels at a time, each store spills 4 bytes past the 12 it fills
+    // so the last few pixels are left to the scalar loop
+    const __m128i drop_alpha = _mm_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+    );
+    for (; x + 6 <= width; x += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i *)(src + x * PIXEL_SIZE));
+        _mm_storeu_si128(
+            (__m128i *)(dst + x * 3), _mm_shuffle_epi8(px, drop_alpha)
+        );
+    }
+#endif
+    for (; x < width; x++) {
+        memcpy(dst + x * 3, src + x * PIXEL_SIZE, 3);
+    }
+}
+
+static void rgba_to_pam(uint8_t *dst, const uint8_t *src, uint32_t width) {
+    const uint32_t flip = pack_color((doodle_color) { .a = opacity(0) });
+    for (uint32_t x = 0; x < width; x++) {
+        uint32_t px;
+        memcpy(&px, src + x * PIXEL_SIZE, sizeof px);
+        px ^= flip;
+        memcpy(dst + x * PIXEL_SIZE, &px, sizeof px);
+    }
+}
+
+// converts the rows img holds a block at a time, writing each block in one go
+static bool write_rows(
+    doodle_image *img, 
+    FILE *out, 
+    size_t channels, 
+    row_converter convert
+) {
+    size_t row_size = (size_t)img->width * channels;
+    size_t rows = row_size > 0 ? EXPORT_BUFFER_SIZE / row_size : 0;
+    if (rows == 0) {
+        rows = 1;
+    }
+    if (rows > img->rows) {
+        rows = img->rows;
+    }
+
+    uint8_t *buf = malloc(rows * row_size);
+    if (buf == NULL && rows * row_size > 0) {
         return false;
     }
 
-    for (size_t i = 0; i < img->width * img->height; i ++) {
-        fwrite(img->pixels + i * PIXEL_SIZE, 3, 1, out);
-        if (ferror(out)) {
-            return false;
+    bool written = true;
+    uint32_t end = img->y0 + img->rows;
+    for (uint32_t y = img->y0; y < end && written; y += rows) {
+        size_t n = end - y < rows ? end - y : rows;
+        for (size_t i = 0; i < n; i++) {
+            convert(
+                buf + i * row_size, 
+                (const uint8_t *)pixel_row(img, y + i), 
+                img->width
+            );
         }
+        written = fwrite(buf, row_size, n, out) == n;
     }
 
-    return true;
+    free(buf);
+    return written;
+}
+
+static bool write_ppm_header(uint32_t width, uint32_t height, FILE *out) {
+    return fprintf(out, "P6\n%"PRId32" %"PRId32"\n255\n", width, height) >= 0;
+}
+
+static bool write_pam_header(uint32_t width, uint32_t height, FILE *out) {
+    return fprintf(
+        out, 
+        "P7\nWIDTH %"PRIu32"\nHEIGHT %"PRIu32"\nDEPTH 4\nMAXVAL 255\n"
+        "TUPLTYPE RGB_ALPHA\nENDHDR\n", 
+        width, height
+    ) >= 0;
 }
 
-bool doodle_export_png(doodle_image *img, FILE *out) {
-    uint8_t **pixel_rows = malloc(img->height * sizeof *pixel_rows);
-    for (size_t i = 0; i < img->height; i++) {
-        pixel_rows[i] = img->pixels + i * img->width * PIXEL_SIZE;
+static void raw_header(uint8_t *header, uint32_t width, uint32_t height) {
+    memset(header, 0, DOODLE_RAW_HEADER_SIZE);
+    memcpy(header, "DRAW", 4);
+    put_u32(header + 4, width);
+    put_u32(header + 8, height);
+}
+
+// Raw pixels are RGBA, with opacity like the other formats rather than the
+// transparency the image holds. The rows are flipped in place around the
+// write and back after, so they still go out without a copy.
+static void flip_alpha(doodle_image *img) {
+    size_t size = (size_t)img->width * img->rows * PIXEL_SIZE;
+    for (size_t i = 3; i < size; i += PIXEL_SIZE) {
+        img->pixels[i] = opacity(img->pixels[i]);
     }
+}
 
-    png_structp png_p = png_create_write_struct(
+static bool write_raw_header(uint32_t width, uint32_t height, FILE *out) {
+    uint8_t header[DOODLE_RAW_HEADER_SIZE];
+    raw_header(header, width, height);
+    return fwrite(header, 1, sizeof header, out) == sizeof header;
+}
+
+static bool write_raw_rows(doodle_image *img, FILE *out) {
+    size_t row_size = (size_t)img->width * PIXEL_SIZE;
+    return fwrite(img->pixels, row_size, img->rows, out) == img->rows;
+}
+
+// Where out is a file the header and pixels go out in as few writev calls as
+// it takes, skipping stdio's buffer. Streams without a descriptor, like the
+// daemon's memory stream, are written as usual.
+static bool write_raw(doodle_image *img, FILE *out) {
+    uint8_t header[DOODLE_RAW_HEADER_SIZE];
+    raw_header(header, img->width, img->height);
+
+    int fd = fileno(out);
+    if (fd < 0) {
+        return fwrite(header, 1, sizeof header, out) == sizeof header
+            && write_raw_rows(img, out);
+    }
+    if (fflush(out) != 0) {
+        return false;
+    }
+
+    struct iovec parts[2] = {
+        { .iov_base = header, .iov_len = sizeof header },
+        {
+            .iov_base = img->pixels,
+            .iov_len = (size_t)img->width * PIXEL_SIZE * img->rows,
+        },
+    };
+    for (int i = 0; i < 2;) {
+        if (parts[i].iov_len == 0) {
+            i++;
+            continue;
+        }
+        ssize_t n = writev(fd, parts + i, 2 - i);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        for (; i < 2 && (size_t)n >= parts[i].iov_len; i++) {
+            n -= parts[i].iov_len;
+        }
+        if (i < 2) {
+            parts[i].iov_base = (uint8_t *)parts[i].iov_base + n;
+            parts[i].iov_len -= n;
+        }
+    }
+    return true;
+}
+
+bool doodle_export_ppm(doodle_image *img, FILE *out) {
+    return write_ppm_header(img->width, img->height, out)
+        && write_rows(img, out, 3, rgba_to_rgb);
+}
+
+bool doodle_export_pam(doodle_image *img, FILE *out) {
+    return write_pam_header(img->width, img->height, out)
+        && write_rows(img, out, PIXEL_SIZE, rgba_to_pam);
+}
+
+bool doodle_export_raw(doodle_image *img, FILE *out) {
+    flip_alpha(img);
+    bool written = write_raw(img, out);
+    flip_alpha(img);
+    return written;
+}
+
+struct doodle_writer {
+    doodle_file_type ft;
+    FILE *out;
+    png_structp png_p;
+    png_infop info_p;
+    doodle_png_layout layout;
+    doodle_qoi qoi;
+    // a row of pixels laid out for the PNG, or encoded QOI waiting to be
+    // written
+    uint8_t *buf;
+    size_t buf_size;
+    bool failed;
+};
+
+static bool start_png(
+    doodle_writer *w, 
+    uint32_t width, 
+    uint32_t height, 
+    doodle_png_profile profile, 
+    const doodle_png_layout *layout
+) {
+    w->layout = *layout;
+    w->buf_size = doodle_png_row_size(&w->layout, width);
+    w->buf = malloc(w->buf_size);
+    if (w->buf == NULL) return false;
+
+    w->png_p = png_create_write_struct(
         PNG_LIBPNG_VER_STRING, NULL, NULL, NULL
     );
-    if (png_p == NULL) goto png_p_error;
+    if (w->png_p == NULL) return false;
 
-    png_infop info_p = png_create_info_struct(png_p);
-    if (info_p == NULL) goto info_p_error;
+    w->info_p = png_create_info_struct(w->png_p);
+    if (w->info_p == NULL) return false;
 
-    if (setjmp(png_jmpbuf(png_p))) goto png_error;
+    if (setjmp(png_jmpbuf(w->png_p))) return false;
 
-    png_init_io(png_p, out);
+    png_init_io(w->png_p, w->out);
 
     png_set_IHDR(
-        png_p, info_p,
-        img->width, img->height, 
-        8, PNG_COLOR_TYPE_RGBA,
+        w->png_p, w->info_p,
+        width, height, 
+        w->layout.bit_depth, w->layout.color_type,
         PNG_INTERLACE_NONE,
         PNG_COMPRESSION_TYPE_DEFAULT,
         PNG_FILTER_TYPE_DEFAULT
     );
-    png_set_invert_alpha(png_p);
+    if (w->layout.color_type == DOODLE_PNG_INDEXED) {
+        png_set_PLTE(
+            w->png_p, w->info_p, 
+            (png_const_colorp)w->layout.plte, w->layout.colors
+        );
+        if (w->layout.translucent > 0) {
+            png_set_tRNS(
+                w->png_p, w->info_p, 
+                w->layout.trns, w->layout.translucent, NULL
+            );
+        }
+    }
 
-    png_write_info(png_p, info_p);
-    png_write_image(png_p, pixel_rows);
-    png_write_end(png_p, NULL);
+    switch (profile) {
+    case DOODLE_PNG_BALANCED:
+        break;
+    case DOODLE_PNG_FASTEST:
+        // one cheap filter, so no row is tried more than once, and none at
+        // all for palette indices
+        png_set_filter(
+            w->png_p, PNG_FILTER_TYPE_BASE, 
+            w->layout.color_type == DOODLE_PNG_INDEXED
+                ? PNG_FILTER_NONE
+                : PNG_FILTER_SUB
+        );
+        png_set_compression_level(w->png_p, 1);
+        break;
+    case DOODLE_PNG_SMALLEST:
+        // every filter is tried on every row
+        png_set_filter(w->png_p, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
+        png_set_compression_level(w->png_p, 9);
+        png_set_compression_mem_level(w->png_p, 9);
+        break;
+    }
 
-    free(pixel_rows);
-    png_destroy_write_struct(&png_p, &info_p);
+    png_write_info(w->png_p, w->info_p);
+    return true;
+}
+
+static bool start_qoi(doodle_writer *w, uint32_t width, uint32_t height) {
+    w->buf_size = DOODLE_QOI_ROW_MAX(width);
+    if (w->buf_size < EXPORT_BUFFER_SIZE) {
+        w->buf_size = EXPORT_BUFFER_SIZE;
+    }
+    w->buf = malloc(w->buf_size);
+    if (w->buf == NULL) {
+        return false;
+    }
 
+    doodle_qoi_start(&w->qoi, w->buf, width, height);
+    return fwrite(w->buf, 1, DOODLE_QOI_HEADER_SIZE, w->out)
+        == DOODLE_QOI_HEADER_SIZE;
+}
+
+static doodle_writer *writer_new(
+    doodle_file_type ft, 
+    doodle_png_profile profile, 
+    const doodle_png_layout *layout, 
+    uint32_t width, 
+    uint32_t height, 
+    FILE *out
+) {
+    doodle_writer *w = malloc(sizeof *w);
+    if (w == NULL) {
+        return NULL;
+    }
+    *w = (doodle_writer) { .ft = ft, .out = out };
+
+    bool started = false;
+    switch (ft) {
+    case DOODLE_FT_PPM:
+        started = write_ppm_header(width, height, out);
+        break;
+    case DOODLE_FT_PNG:
+        started = start_png(w, width, height, profile, layout);
+        break;
+    case DOODLE_FT_PAM:
+        started = write_pam_header(width, height, out);
+        break;
+    case DOODLE_FT_RAW:
+        started = write_raw_header(width, height, out);
+        break;
+    case DOODLE_FT_QOI:
+        started = start_qoi(w, width, height);
+        break;
+    }
+
+    if (!started) {
+        w->failed = true;
+        doodle_writer_end(w);
+        return NULL;
+    }
+    return w;
+}
+
+doodle_writer *doodle_writer_new(
+    const doodle_config *conf, 
+    const doodle_palette *palette, 
+    FILE *out
+) {
+    doodle_png_layout layout;
+    doodle_png_layout_pick(&layout, palette);
+    return writer_new(
+        conf->ft, conf->png_profile, &layout, conf->width, conf->height, out
+    );
+}
+
+static bool write_png_rows(doodle_writer *w, doodle_image *img) {
+    if (setjmp(png_jmpbuf(w->png_p))) return false;
+
+    uint32_t end = img->y0 + img->rows;
+    for (uint32_t y = img->y0; y < end; y++) {
+        if (!doodle_png_row(
+                &w->layout, w->buf, (const uint8_t *)pixel_row(img, y), 
+                img->width
+            )
+        ) {
+            return false;
+        }
+        png_write_row(w->png_p, w->buf);
+    }
     return true;
+}
 
-png_error:
-    png_destroy_write_struct(NULL, &info_p);
-info_p_error:
-    png_destroy_write_struct(&png_p, NULL);
-png_p_error:
-    free(pixel_rows);
-    return false;
+// rows are encoded into the buffer, which is written whenever another row
+// might not fit
+static bool write_qoi_rows(doodle_writer *w, doodle_image *img) {
+    size_t row_max = DOODLE_QOI_ROW_MAX(img->width);
+    size_t used = 0;
+
+    uint32_t end = img->y0 + img->rows;
+    for (uint32_t y = img->y0; y < end; y++) {
+        if (w->buf_size - used < row_max) {
+            if (fwrite(w->buf, 1, used, w->out) != used) {
+                return false;
+            }
+            used = 0;
+        }
+        used += doodle_qoi_row(
+            &w->qoi, w->buf + used, 
+            (const uint8_t *)pixel_row(img, y), img->width
+        );
+    }
+    return fwrite(w->buf, 1, used, w->out) == used;
+}
+
+bool doodle_writer_rows(doodle_writer *w, doodle_image *img) {
+    if (w->failed) {
+        return false;
+    }
+
+    bool written = false;
+    switch (w->ft) {
+    case DOODLE_FT_PPM:
+        written = write_rows(img, w->out, 3, rgba_to_rgb);
+        break;
+    case DOODLE_FT_PNG:
+        written = write_png_rows(w, img);
+        break;
+    case DOODLE_FT_PAM:
+        written = write_rows(img, w->out, PIXEL_SIZE, rgba_to_pam);
+        break;
+    case DOODLE_FT_RAW:
+        flip_alpha(img);
+        written = write_raw_rows(img, w->out);
+        flip_alpha(img);
+        break;
+    case DOODLE_FT_QOI:
+        written = write_qoi_rows(w, img);
+        break;
+    }
+
+    w->failed = !written;
+    return written;
+}
+
+static bool end_png(doodle_writer *w) {
+    if (setjmp(png_jmpbuf(w->png_p))) return false;
+
+    png_write_end(w->png_p, NULL);
+    return true;
+}
+
+static bool end_qoi(doodle_writer *w) {
+    size_t size = doodle_qoi_end(&w->qoi, w->buf);
+    return fwrite(w->buf, 1, size, w->out) == size;
+}
+
+bool doodle_writer_end(doodle_writer *w) {
+    bool ended = !w->failed;
+    if (w->png_p != NULL) {
+        ended = ended && end_png(w);
+        png_destroy_write_struct(
+            &w->png_p, w->info_p != NULL ? &w->info_p : NULL
+        );
+    }
+    if (w->ft == DOODLE_FT_QOI && w->buf != NULL) {
+        ended = ended && end_qoi(w);
+    }
+
+    free(w->buf);
+    free(w);
+    return ended;
+}
+
+bool doodle_export_png(
+    doodle_image *img, 
+    const doodle_config *conf, 
+    FILE *out
+) {
+    doodle_png_layout layout;
+    doodle_png_layout_pick(&layout, &img->palette);
+    doodle_png_layout_fit(
+        &layout, img->pixels, (size_t)img->width * img->height
+    );
+
+    uint32_t threads = conf->png_parallel ? doodle_thread_count(conf) : 1;
+    if (threads > 1) {
+        return doodle_png_parallel(
+            img->pixels, &layout, img->width, img->height, 
+            conf->png_profile, threads, out
+        );
+    }
+
+    doodle_writer *w = writer_new(
+        DOODLE_FT_PNG, conf->png_profile, &layout, 
+        img->width, img->height, out
+    );
+    if (w == NULL) {
+        return false;
+    }
+    doodle_writer_rows(w, img);
+    return doodle_writer_end(w);
+}
+
+bool doodle_export_qoi(doodle_image *img, FILE *out) {
+    doodle_writer *w = writer_new(
+        DOODLE_FT_QOI, DOODLE_PNG_BALANCED, NULL, img->width, img->height, out
+    );
+    if (w == NULL) {
+        return false;
+    }
+    doodle_writer_rows(w, img);
+    return doodle_writer_end(w);
 }
@@ -2,6 +2,7 @@
 #define DOODLE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -10,22 +11,159 @@
 typedef enum {
     DOODLE_FT_PPM,
     DOODLE_FT_PNG,
+    DOODLE_FT_PAM, // RGB_ALPHA
+    DOODLE_FT_RAW, // a short header and the pixels as RGBA
+    DOODLE_FT_QOI,
 } doodle_file_type;
 
+// how hard the PNG encoder works to shrink its output
+typedef enum {
+    DOODLE_PNG_BALANCED, // libpng's defaults
+    DOODLE_PNG_FASTEST,
+    DOODLE_PNG_SMALLEST,
+} doodle_png_profile;
+
 typedef struct doodle_image doodle_image;
 
+// the pixels of an image already drawn by later draws in a back to front pass
+typedef struct doodle_coverage doodle_coverage;
+
 typedef struct {
     uint8_t r, g, b, a;
 } doodle_color;
 
+#define DOODLE_PALETTE_SIZE 256
+
+// The distinct colours drawn, kept while they fit, so images that use few can
+// be written indexed. Colours are found through slots, which hash to their
+// index + 1.
+typedef struct {
+    uint32_t count;
+    bool overflow; // more colours were added than fit
+    bool translucent; // some colour isn't fully opaque
+    doodle_color colors[DOODLE_PALETTE_SIZE];
+    uint16_t slots[2 * DOODLE_PALETTE_SIZE];
+} doodle_palette;
+
+typedef enum {
+    DOODLE_RENDER_BANDS,
+    DOODLE_RENDER_TILES,
+    DOODLE_RENDER_CULLED,
+} doodle_render_mode;
+
+// draws removed from a queue by doodle_queue_optimize
+typedef struct {
+    size_t culled; // couldn't touch the image
+    size_t duplicates; // drawn again identically later on
+    size_t merged; // rectangles folded into a neighbour
+} doodle_queue_stats;
+
 typedef struct {
     doodle_color background;
     uint32_t width;
     uint32_t height;
     doodle_file_type ft;
+    doodle_png_profile png_profile;
+    uint32_t band_height; // rows rendered at a time when streaming, 0 for all
+    doodle_render_mode render;
+    uint32_t threads; // 0 for one per core
+    // deflate PNGs on the threads by hand rather than through libpng
+    bool png_parallel;
+    uint32_t tile_size; // 0 for the default
+    bool optimize;
+    bool ffi; // give scripts the ffi drawing module, trusted scripts only
+    // bytes for the script, its queued draws and the image, 0 for no limit
+    size_t memory_limit;
+    // milliseconds of cpu time on the script's thread, 0 for no limit
+    uint32_t time_limit;
+    // the script's garbage collector settings, as percentages, 0 for defaults
+    uint32_t gc_pause;
+    uint32_t gc_stepmul;
+    doodle_queue_stats stats; // filled in when optimizing
 } doodle_config;
 
+// half open rectangle of pixels [x0, x1) x [y0, y1)
+typedef struct {
+    uint32_t x0, y0;
+    uint32_t x1, y1;
+} doodle_region;
+
+typedef enum {
+    DOODLE_DRAW_RECT,
+    DOODLE_DRAW_CIRCLE,
+    DOODLE_DRAW_LINE,
+} doodle_draw_type;
+
+typedef struct {
+    doodle_point origin;
+    uint32_t width;
+    uint32_t height;
+    doodle_color color;
+} doodle_rect_draw;
+
+typedef struct {
+    doodle_point origin;
+    uint32_t radius;
+    doodle_color color;
+} doodle_circle_draw;
+
+typedef struct {
+    doodle_point p1;
+    doodle_point p2;
+    double thickness;
+    doodle_color color;
+} doodle_line_draw;
+
+typedef struct {
+    doodle_draw_type type;
+    union {
+        doodle_rect_draw rect;
+        doodle_circle_draw circle;
+        doodle_line_draw line;
+    } params;
+} doodle_draw;
+
+void doodle_palette_clear(doodle_palette *p);
+void doodle_palette_add(doodle_palette *p, doodle_color c);
+void doodle_palette_merge(doodle_palette *p, const doodle_palette *from);
+// c's index in p, -1 if it isn't there
+int doodle_palette_find(const doodle_palette *p, doodle_color c);
+
+doodle_color doodle_draw_color(const doodle_draw *d);
+
+// bytes needed for a conf->width x conf->height image, SIZE_MAX if too many
+size_t doodle_size(const doodle_config *conf);
 doodle_image *doodle_new(doodle_config *conf);
+// Reuses img's memory, which may be NULL, for a new image. If that fails img
+// is left as it was.
+doodle_image *doodle_renew(doodle_image *img, doodle_config *conf);
+
+// A new width x height copy of img, which can't be a band, each pixel the
+// average of those it covers. NULL if img is smaller either way.
+doodle_image *doodle_downscale(
+    const doodle_image *img, 
+    uint32_t width, 
+    uint32_t height
+);
+
+// Bands hold up to rows rows of a conf->width x conf->height image at a time,
+// they're drawn on like a whole image but only the rows held are touched.
+size_t doodle_band_size(const doodle_config *conf, uint32_t rows);
+doodle_image *doodle_band_new(const doodle_config *conf, uint32_t rows);
+// clears band to the background for the rows from y0, as many as fit
+void doodle_band_move(
+    doodle_image *band, 
+    const doodle_config *conf, 
+    uint32_t y0
+);
+// the pixels img holds, all of them unless it's a band
+doodle_region doodle_image_region(const doodle_image *img);
+
+// The colours in img, the background and those of every draw made through
+// doodle_draw_rect and the like or by doodle_render. Clipped and beneath
+// draws are left to their callers to add.
+const doodle_palette *doodle_image_palette(const doodle_image *img);
+void doodle_image_add_colors(doodle_image *img, const doodle_palette *p);
 
 void doodle_draw_rect(
     doodle_image *img, 
@@ -50,9 +188,92 @@ void doodle_draw_line(
     doodle_color color
 );
 
+// the pixels d may touch on a width x height image, false if there are none
+bool doodle_draw_bounds(
+    const doodle_draw *d,
+    uint32_t width,
+    uint32_t height,
+    doodle_region *bounds
+);
+
+// the pixels d may touch within rows [y0, y1), false if there are none
+bool doodle_draw_band_bounds(
+    const doodle_draw *d,
+    uint32_t width,
+    uint32_t height,
+    uint32_t y0,
+    uint32_t y1,
+    doodle_region *bounds
+);
+
+// draws d, touching only the pixels inside clip
+void doodle_draw_clipped(
+    doodle_image *img, 
+    const doodle_draw *d, 
+    doodle_region clip
+);
+
+// Draws d on a width x height canvas of which img holds the pixels from
+// (x0, y0) on, touching only the pixels inside clip. Draws land on the same
+// pixels they would on the whole canvas.
+void doodle_draw_window(
+    doodle_image *img, 
+    const doodle_draw *d, 
+    uint32_t width, 
+    uint32_t height, 
+    int64_t x0, 
+    int64_t y0, 
+    doodle_region clip
+);
+
+doodle_coverage *doodle_coverage_new(uint32_t width, uint32_t height);
+// memory doodle_coverage_new takes for a width x height image
+size_t doodle_coverage_size(uint32_t width, uint32_t height);
+
+// Draws d underneath everything recorded in cov, only pixels inside clip that
+// haven't been covered yet are written, and those become covered. Draws that
+// are hidden entirely are skipped without being rasterized.
+void doodle_draw_beneath(
+    doodle_image *img, 
+    const doodle_draw *d, 
+    doodle_region clip,
+    doodle_coverage *cov
+);
+
 bool doodle_export_ppm(doodle_image *img, FILE *out);
-bool doodle_export_png(doodle_image *img, FILE *out);
+// encoded with conf->png_profile, on conf->threads workers if
+// conf->png_parallel asks for it and that's more than one, and indexed if
+// the image's palette allows
+bool doodle_export_png(
+    doodle_image *img, 
+    const doodle_config *conf, 
+    FILE *out
+);
+bool doodle_export_pam(doodle_image *img, FILE *out);
+#define DOODLE_RAW_HEADER_SIZE 16
+
+// A header of "DRAW", the width and height as big endian 32 bit numbers and
+// 4 zero bytes, then width x height RGBA pixels in rows from the top, written
+// in one go. Alpha is opacity, 255 for opaque, as in PAM and QOI.
+bool doodle_export_raw(doodle_image *img, FILE *out);
+// QOI, lossless like PNG but far cheaper to encode for a larger file
+bool doodle_export_qoi(doodle_image *img, FILE *out);
 
 bool doodle_export(doodle_image *img, doodle_config *conf, FILE *out);
 
+// Writes an image as conf->ft a band of rows at a time, so it never needs to
+// be held whole. Bands are given top to bottom.
+typedef struct doodle_writer doodle_writer;
+
+// palette holds every colour the bands will, so PNGs can be indexed, or is
+// NULL if that isn't known
+doodle_writer *doodle_writer_new(
+    const doodle_config *conf, 
+    const doodle_palette *palette, 
+    FILE *out
+);
+bool doodle_writer_rows(doodle_writer *w, doodle_image *img);
+// finishes the file and frees w, false if anything along the way failed
+bool doodle_writer_end(doodle_writer *w);
+
 #endif
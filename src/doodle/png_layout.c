@@ -0,0 +1,161 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bytes.h"
+#include "png_layout.h"
+
+static void pick_indexed(doodle_png_layout *l, const doodle_palette *p) {
+    l->color_type = DOODLE_PNG_INDEXED;
+    l->bit_depth = p->count <= 2 ? 1
+        : p->count <= 4 ? 2
+        : p->count <= 16 ? 4
+        : 8;
+    l->filter_bytes = 1;
+    l->colors = p->count;
+
+    // tRNS only needs to cover entries up to the last translucent one, so
+    // those go first
+    uint32_t next = 0;
+    for (int translucent = 1; translucent >= 0; translucent--) {
+        for (uint32_t i = 0; i < p->count; i++) {
+            doodle_color c = p->colors[i];
+            if ((c.a != 0) != translucent) continue;
+
+            l->entry[i] = next;
+            l->plte[3 * next] = c.r;
+            l->plte[3 * next + 1] = c.g;
+            l->plte[3 * next + 2] = c.b;
+            l->trns[next] = opacity(c.a);
+            next++;
+        }
+        if (translucent) {
+            l->translucent = next;
+        }
+    }
+}
+
+static void pick_direct(doodle_png_layout *l, bool translucent) {
+    l->bit_depth = 8;
+    if (translucent) {
+        l->color_type = DOODLE_PNG_RGBA;
+        l->filter_bytes = 4;
+    } else {
+        l->color_type = DOODLE_PNG_RGB;
+        l->filter_bytes = 3;
+    }
+}
+
+void doodle_png_layout_pick(doodle_png_layout *l, const doodle_palette *p) {
+    *l = (doodle_png_layout) { .palette = p };
+
+    if (p != NULL && !p->overflow && p->count > 0) {
+        pick_indexed(l, p);
+    } else {
+        pick_direct(l, p == NULL || p->translucent);
+    }
+}
+
+// whether every colour among the count pixels at src is in l's palette
+static bool in_palette(
+    const doodle_png_layout *l, 
+    const uint8_t *src, 
+    size_t count
+) {
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *px = src + i * PIXEL_SIZE;
+        if (i > 0 && memcmp(px, px - PIXEL_SIZE, PIXEL_SIZE) == 0) {
+            continue;
+        }
+        doodle_color c = { px[0], px[1], px[2], px[3] };
+        if (doodle_palette_find(l->palette, c) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void doodle_png_layout_fit(
+    doodle_png_layout *l, 
+    const uint8_t *src, 
+    size_t count
+) {
+    if (l->color_type == DOODLE_PNG_RGBA) return;
+    if (l->color_type == DOODLE_PNG_INDEXED && in_palette(l, src, count)) {
+        return;
+    }
+
+    bool translucent = false;
+    for (size_t i = 0; i < count && !translucent; i++) {
+        translucent = src[i * PIXEL_SIZE + 3] != 0;
+    }
+    pick_direct(l, translucent);
+}
+
+size_t doodle_png_row_size(const doodle_png_layout *l, uint32_t width) {
+    switch (l->color_type) {
+    case DOODLE_PNG_INDEXED:
+        return ((size_t)width * l->bit_depth + 7) / 8;
+    case DOODLE_PNG_RGB:
+        return (size_t)width * 3;
+    default:
+        return (size_t)width * PIXEL_SIZE;
+    }
+}
+
+// neighbouring pixels are usually the same colour, so the last lookup is
+// kept
+static bool indexed_row(
+    const doodle_png_layout *l, 
+    uint8_t *dst, 
+    const uint8_t *src, 
+    uint32_t width
+) {
+    memset(dst, 0, doodle_png_row_size(l, width));
+
+    uint32_t per_byte = 8 / l->bit_depth;
+    uint8_t last[PIXEL_SIZE];
+    uint8_t entry = 0;
+    bool found = false;
+    for (uint32_t x = 0; x < width; x++) {
+        const uint8_t *px = src + (size_t)x * PIXEL_SIZE;
+        if (!found || memcmp(px, last, PIXEL_SIZE) != 0) {
+            doodle_color c = { px[0], px[1], px[2], px[3] };
+            int i = doodle_palette_find(l->palette, c);
+            if (i < 0) {
+                return false;
+            }
+            entry = l->entry[i];
+            memcpy(last, px, PIXEL_SIZE);
+            found = true;
+        }
+
+        uint32_t shift = 8 - l->bit_depth * (x % per_byte + 1);
+        dst[x / per_byte] |= entry << shift;
+    }
+    return true;
+}
+
+bool doodle_png_row(
+    const doodle_png_layout *l, 
+    uint8_t *dst, 
+    const uint8_t *src, 
+    uint32_t width
+) {
+    switch (l->color_type) {
+    case DOODLE_PNG_INDEXED:
+        return indexed_row(l, dst, src, width);
+    case DOODLE_PNG_RGB:
+        for (uint32_t x = 0; x < width; x++) {
+            memcpy(dst + x * 3, src + x * PIXEL_SIZE, 3);
+        }
+        break;
+    default:
+        for (size_t i = 0; i < (size_t)width * PIXEL_SIZE; i += PIXEL_SIZE) {
+            memcpy(dst + i, src + i, 3);
+            dst[i + 3] = opacity(src[i + 3]);
+        }
+        break;
+    }
+    return true;
+}
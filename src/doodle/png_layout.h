@@ -0,0 +1,53 @@
+#ifndef DOODLE_PNG_LAYOUT_H
+#define DOODLE_PNG_LAYOUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "doodle.h"
+
+// PNG's colour types
+#define DOODLE_PNG_RGB 2
+#define DOODLE_PNG_INDEXED 3
+#define DOODLE_PNG_RGBA 6
+
+// How an image's pixels are stored in a PNG. Images with few enough colours
+// are indexed, at the smallest bit depth that holds their palette, and the
+// rest are RGB unless some colour isn't opaque.
+typedef struct {
+    uint8_t color_type;
+    uint8_t bit_depth;
+    uint8_t filter_bytes; // bytes per pixel as filters see them, at least 1
+    uint32_t colors; // entries in plte
+    uint32_t translucent; // entries in trns, the first ones in plte
+    uint8_t plte[3 * DOODLE_PALETTE_SIZE];
+    uint8_t trns[DOODLE_PALETTE_SIZE];
+    const doodle_palette *palette;
+    uint8_t entry[DOODLE_PALETTE_SIZE]; // palette index to plte entry
+} doodle_png_layout;
+
+// picks the layout for an image using the colours in p, NULL if unknown
+void doodle_png_layout_pick(doodle_png_layout *l, const doodle_palette *p);
+
+// Checks the count pixels at src against the layout picked for them. Pixels
+// drawn without adding their colours to the palette can leave it short, and
+// then the layout falls back to RGB, or RGBA if some pixel isn't opaque.
+void doodle_png_layout_fit(
+    doodle_png_layout *l, 
+    const uint8_t *src, 
+    size_t count
+);
+
+size_t doodle_png_row_size(const doodle_png_layout *l, uint32_t width);
+
+// converts width pixels of an image to a row laid out as l says, false if an
+// indexed row has a colour that isn't in the palette
+bool doodle_png_row(
+    const doodle_png_layout *l, 
+    uint8_t *dst, 
+    const uint8_t *src, 
+    uint32_t width
+);
+
+#endif
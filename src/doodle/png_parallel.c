@@ -0,0 +1,400 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "bytes.h"
+#include "png_layout.h"
+#include "png_parallel.h"
+#include "workers.h"
+
+// blocks with less raw data than this aren't worth a thread
+#define MIN_BLOCK_BYTES (256 * 1024)
+// deflate's window, primed from the rows ahead of a block
+#define WINDOW_SIZE 32768
+#define IDAT_SIZE (1024 * 1024)
+
+enum {
+    FILTER_NONE,
+    FILTER_SUB,
+    FILTER_UP,
+    FILTER_AVERAGE,
+    FILTER_PAETH,
+    FILTER_COUNT,
+};
+
+// rows [y0, y1) of the image, deflated into data along with the adler32 of
+// the filtered rows
+typedef struct {
+    const uint8_t *pixels;
+    const doodle_png_layout *layout;
+    uint32_t width;
+    uint32_t y0, y1;
+    doodle_png_profile profile;
+    bool last;
+    uint8_t *data;
+    size_t size, cap;
+    uint32_t adler;
+    bool ok;
+} png_block;
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// writes the filter type and then row filtered against up, the row above,
+// with bpp bytes to a pixel
+static void filter_row(
+    uint8_t *out, 
+    uint8_t type, 
+    const uint8_t *row, 
+    const uint8_t *up, 
+    size_t size, 
+    size_t bpp
+) {
+    *out++ = type;
+
+    size_t i = 0;
+    switch (type) {
+    case FILTER_NONE:
+        memcpy(out, row, size);
+        break;
+    case FILTER_SUB:
+        for (; i < bpp; i++) out[i] = row[i];
+        for (; i < size; i++) out[i] = row[i] - row[i - bpp];
+        break;
+    case FILTER_UP:
+        for (; i < size; i++) out[i] = row[i] - up[i];
+        break;
+    case FILTER_AVERAGE:
+        for (; i < bpp; i++) out[i] = row[i] - (up[i] >> 1);
+        for (; i < size; i++) {
+            out[i] = row[i] - ((row[i - bpp] + up[i]) >> 1);
+        }
+        break;
+    case FILTER_PAETH:
+        for (; i < bpp; i++) out[i] = row[i] - up[i];
+        for (; i < size; i++) {
+            out[i] = row[i]
+                - paeth(row[i - bpp], up[i], up[i - bpp]);
+        }
+        break;
+    }
+}
+
+// libpng's heuristic, the sum of the filtered bytes taken as signed
+static uint64_t filter_cost(const uint8_t *filtered, size_t size) {
+    uint64_t cost = 0;
+    for (size_t i = 1; i <= size; i++) {
+        cost += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+    }
+    return cost;
+}
+
+// filters row into best, using trial as scratch, returns the filtered row
+static uint8_t *filter_best(
+    const png_block *b, 
+    uint8_t *best, 
+    uint8_t *trial, 
+    const uint8_t *row, 
+    const uint8_t *up, 
+    size_t size
+) {
+    size_t bpp = b->layout->filter_bytes;
+    // palette indices are rarely helped by filtering, as libpng also assumes
+    if (b->layout->color_type == DOODLE_PNG_INDEXED
+        && b->profile != DOODLE_PNG_SMALLEST
+    ) {
+        filter_row(best, FILTER_NONE, row, up, size, bpp);
+        return best;
+    }
+    if (b->profile == DOODLE_PNG_FASTEST) {
+        filter_row(best, FILTER_SUB, row, up, size, bpp);
+        return best;
+    }
+
+    filter_row(best, FILTER_NONE, row, up, size, bpp);
+    uint64_t best_cost = filter_cost(best, size);
+    for (uint8_t type = FILTER_SUB; type < FILTER_COUNT; type++) {
+        filter_row(trial, type, row, up, size, bpp);
+        uint64_t cost = filter_cost(trial, size);
+        if (cost < best_cost) {
+            uint8_t *swap = best;
+            best = trial;
+            trial = swap;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+static bool grow(png_block *b, size_t needed) {
+    if (b->cap - b->size >= needed) {
+        return true;
+    }
+
+    size_t cap = b->cap * 2 > b->size + needed ? b->cap * 2 : b->size + needed;
+    uint8_t *data = realloc(b->data, cap);
+    if (data == NULL) {
+        return false;
+    }
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
+
+static bool deflate_into(
+    png_block *b, 
+    z_stream *z, 
+    const uint8_t *in, 
+    size_t size, 
+    int flush
+) {
+    z->next_in = (Bytef *)in;
+    z->avail_in = size;
+
+    for (;;) {
+        if (!grow(b, 1)) {
+            return false;
+        }
+        size_t room = b->cap - b->size;
+        z->next_out = b->data + b->size;
+        z->avail_out = room < UINT_MAX ? room : UINT_MAX;
+
+        int rc = deflate(z, flush);
+        b->size = z->next_out - b->data;
+        if (rc == Z_STREAM_ERROR) {
+            return false;
+        }
+        if (flush == Z_FINISH
+            ? rc == Z_STREAM_END
+            : z->avail_in == 0 && z->avail_out > 0
+        ) {
+            return true;
+        }
+    }
+}
+
+static int zlib_level(doodle_png_profile profile) {
+    switch (profile) {
+    case DOODLE_PNG_FASTEST: return 1;
+    case DOODLE_PNG_SMALLEST: return 9;
+    default: return Z_DEFAULT_COMPRESSION;
+    }
+}
+
+// The block is deflated raw, ending on a sync flush, or finishing the stream
+// if it's the last, so the blocks can simply be concatenated. Its window is
+// primed with the filtered rows just above it, as the whole image's would
+// have been.
+static void *encode_block(void *data) {
+    png_block *b = data;
+
+    size_t row_size = doodle_png_row_size(b->layout, b->width);
+    size_t stride = (size_t)b->width * PIXEL_SIZE;
+    size_t filtered_size = row_size + 1;
+    uint32_t dict_rows = (WINDOW_SIZE + filtered_size - 1) / filtered_size;
+    uint32_t y = b->y0 > dict_rows ? b->y0 - dict_rows : 0;
+    size_t dict_size = (size_t)(b->y0 - y) * filtered_size;
+
+    uint8_t *rows = calloc(2, row_size);
+    uint8_t *filtered = malloc(2 * filtered_size);
+    uint8_t *dict = malloc(dict_size);
+    z_stream z = { 0 };
+    bool z_ready = false;
+    if (rows == NULL || filtered == NULL || (dict == NULL && dict_size > 0)) {
+        goto encode_block_exit;
+    }
+
+    int mem_level = b->profile == DOODLE_PNG_SMALLEST ? 9 : 8;
+    z_ready = deflateInit2(
+        &z, zlib_level(b->profile), Z_DEFLATED, -15, mem_level, Z_FILTERED
+    ) == Z_OK;
+    size_t block_size = (size_t)(b->y1 - b->y0) * filtered_size;
+    if (!z_ready || !grow(b, deflateBound(&z, block_size))) {
+        goto encode_block_exit;
+    }
+
+    // the row above the first is taken to be all zeros
+    uint8_t *up = rows, *row = rows + row_size;
+    if (y > 0) {
+        doodle_png_row(b->layout, up, b->pixels + (y - 1) * stride, b->width);
+    }
+
+    b->adler = adler32(0, Z_NULL, 0);
+    for (; y < b->y1; y++) {
+        doodle_png_row(b->layout, row, b->pixels + y * stride, b->width);
+        uint8_t *f = filter_best(
+            b, filtered, filtered + filtered_size, row, up, row_size
+        );
+
+        if (y < b->y0) {
+            memcpy(dict + dict_size - (size_t)(b->y0 - y) * filtered_size,
+                f, filtered_size);
+            if (y + 1 == b->y0) {
+                size_t window = dict_size < WINDOW_SIZE 
+                    ? dict_size 
+                    : WINDOW_SIZE;
+                if (deflateSetDictionary(
+                        &z, dict + dict_size - window, window
+                    ) != Z_OK
+                ) {
+                    goto encode_block_exit;
+                }
+            }
+        } else {
+            b->adler = adler32(b->adler, f, filtered_size);
+            if (!deflate_into(b, &z, f, filtered_size, Z_NO_FLUSH)) {
+                goto encode_block_exit;
+            }
+        }
+
+        uint8_t *swap = up;
+        up = row;
+        row = swap;
+    }
+
+    b->ok = deflate_into(b, &z, NULL, 0, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+
+encode_block_exit:
+    if (z_ready) deflateEnd(&z);
+    free(rows);
+    free(filtered);
+    free(dict);
+    return NULL;
+}
+
+static bool write_chunk(
+    FILE *out, 
+    const char *type, 
+    const uint8_t *data, 
+    size_t size
+) {
+    uint8_t length[4], crc[4];
+    put_u32(length, size);
+    uLong c = crc32(0, (const Bytef *)type, 4);
+    if (size > 0) {
+        // crc32 starts over when given no data
+        c = crc32(c, data, size);
+    }
+    put_u32(crc, c);
+
+    return fwrite(length, 1, 4, out) == 4
+        && fwrite(type, 1, 4, out) == 4
+        && (size == 0 || fwrite(data, 1, size, out) == size)
+        && fwrite(crc, 1, 4, out) == 4;
+}
+
+// the zlib header's second byte also says how hard deflate tried
+static uint8_t zlib_flags(doodle_png_profile profile) {
+    switch (profile) {
+    case DOODLE_PNG_FASTEST: return 0x01;
+    case DOODLE_PNG_SMALLEST: return 0xda;
+    default: return 0x9c;
+    }
+}
+
+bool doodle_png_parallel(
+    const uint8_t *pixels, 
+    const doodle_png_layout *layout, 
+    uint32_t width, 
+    uint32_t height, 
+    doodle_png_profile profile, 
+    uint32_t threads, 
+    FILE *out
+) {
+    static const uint8_t signature[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+
+    size_t filtered_size = doodle_png_row_size(layout, width) + 1;
+    uint32_t min_rows = (MIN_BLOCK_BYTES + filtered_size - 1) / filtered_size;
+    uint32_t block_rows = (height + threads - 1) / (threads > 0 ? threads : 1);
+    if (block_rows < min_rows) block_rows = min_rows;
+    if (block_rows == 0) block_rows = 1;
+    uint32_t count = (height + block_rows - 1) / block_rows;
+    if (count == 0) count = 1;
+
+    png_block *blocks = calloc(count, sizeof *blocks);
+    if (blocks == NULL) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t y1 = (i + 1) * block_rows;
+        blocks[i] = (png_block) {
+            .pixels = pixels,
+            .layout = layout,
+            .width = width,
+            .y0 = i * block_rows,
+            .y1 = i + 1 < count && y1 < height ? y1 : height,
+            .profile = profile,
+            .last = i + 1 == count,
+        };
+    }
+
+    // the zlib header goes ahead of the first block's deflate data
+    bool ok = grow(&blocks[0], 2);
+    if (ok) {
+        blocks[0].data[0] = 0x78;
+        blocks[0].data[1] = zlib_flags(profile);
+        blocks[0].size = 2;
+        doodle_run_workers(encode_block, blocks, sizeof *blocks, count);
+    }
+
+    uLong adler = adler32(0, Z_NULL, 0);
+    for (uint32_t i = 0; i < count && ok; i++) {
+        ok = blocks[i].ok;
+        size_t size = (size_t)(blocks[i].y1 - blocks[i].y0) * filtered_size;
+        adler = adler32_combine(adler, blocks[i].adler, size);
+    }
+
+    png_block *last = &blocks[count - 1];
+    ok = ok && grow(last, 4);
+    if (ok) {
+        put_u32(last->data + last->size, adler);
+        last->size += 4;
+    }
+
+    uint8_t header[13];
+    put_u32(header, width);
+    put_u32(header + 4, height);
+    header[8] = layout->bit_depth;
+    header[9] = layout->color_type;
+    header[10] = 0; // deflate
+    header[11] = 0; // adaptive filtering
+    header[12] = 0; // no interlacing
+
+    ok = ok && fwrite(signature, 1, sizeof signature, out) == sizeof signature
+        && write_chunk(out, "IHDR", header, sizeof header);
+    if (layout->color_type == DOODLE_PNG_INDEXED) {
+        ok = ok && write_chunk(out, "PLTE", layout->plte, 3 * layout->colors);
+        if (layout->translucent > 0) {
+            ok = ok && write_chunk(
+                out, "tRNS", layout->trns, layout->translucent
+            );
+        }
+    }
+    for (uint32_t i = 0; i < count && ok; i++) {
+        for (size_t at = 0; at < blocks[i].size && ok; at += IDAT_SIZE) {
+            size_t left = blocks[i].size - at;
+            ok = write_chunk(
+                out, "IDAT", blocks[i].data + at, 
+                left < IDAT_SIZE ? left : IDAT_SIZE
+            );
+        }
+    }
+    ok = ok && write_chunk(out, "IEND", NULL, 0);
+
+    for (uint32_t i = 0; i < count; i++) {
+        free(blocks[i].data);
+    }
+    free(blocks);
+    return ok;
+}
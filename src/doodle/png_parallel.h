@@ -0,0 +1,25 @@
+#ifndef DOODLE_PNG_PARALLEL_H
+#define DOODLE_PNG_PARALLEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "doodle.h"
+#include "png_layout.h"
+
+// Writes width x height pixels, 4 bytes each with transparency rather than
+// opacity, as a PNG laid out as layout says. Blocks of rows are filtered and
+// deflated on up to threads workers and joined into a single zlib stream, the
+// way pigz splits up gzip.
+bool doodle_png_parallel(
+    const uint8_t *pixels, 
+    const doodle_png_layout *layout, 
+    uint32_t width, 
+    uint32_t height, 
+    doodle_png_profile profile, 
+    uint32_t threads, 
+    FILE *out
+);
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "bytes.h"
+#include "qoi.h"
+
+#define OP_INDEX 0x00
+#define OP_DIFF 0x40
+#define OP_LUMA 0x80
+#define OP_RUN 0xc0
+#define OP_RGB 0xfe
+#define OP_RGBA 0xff
+
+#define MAX_RUN 62
+
+void doodle_qoi_start(
+    doodle_qoi *q, 
+    uint8_t *header, 
+    uint32_t width, 
+    uint32_t height
+) {
+    memset(q, 0, sizeof *q);
+    q->prev[3] = 0xff;
+
+    memcpy(header, "qoif", 4);
+    put_u32(header + 4, width);
+    put_u32(header + 8, height);
+    header[12] = 4; // RGBA
+    header[13] = 0; // sRGB with linear alpha
+}
+
+static uint8_t *flush_run(doodle_qoi *q, uint8_t *dst) {
+    if (q->run > 0) {
+        *dst++ = OP_RUN | (q->run - 1);
+        q->run = 0;
+    }
+    return dst;
+}
+
+size_t doodle_qoi_row(
+    doodle_qoi *q, 
+    uint8_t *dst, 
+    const uint8_t *src, 
+    uint32_t width
+) {
+    uint8_t *start = dst;
+
+    for (uint32_t x = 0; x < width; x++, src += 4) {
+        uint8_t px[4] = { src[0], src[1], src[2], opacity(src[3]) };
+        if (memcmp(px, q->prev, 4) == 0) {
+            if (++q->run == MAX_RUN) {
+                dst = flush_run(q, dst);
+            }
+            continue;
+        }
+        dst = flush_run(q, dst);
+
+        uint8_t slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+        if (memcmp(q->index[slot], px, 4) == 0) {
+            *dst++ = OP_INDEX | slot;
+        } else if (px[3] != q->prev[3]) {
+            memcpy(q->index[slot], px, 4);
+            *dst++ = OP_RGBA;
+            memcpy(dst, px, 4);
+            dst += 4;
+        } else {
+            memcpy(q->index[slot], px, 4);
+            int8_t dr = px[0] - q->prev[0];
+            int8_t dg = px[1] - q->prev[1];
+            int8_t db = px[2] - q->prev[2];
+            int8_t dr_dg = dr - dg;
+            int8_t db_dg = db - dg;
+
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1
+                && db >= -2 && db <= 1
+            ) {
+                *dst++ = OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+            } else if (dg >= -32 && dg <= 31
+                && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7
+            ) {
+                *dst++ = OP_LUMA | (dg + 32);
+                *dst++ = (dr_dg + 8) << 4 | (db_dg + 8);
+            } else {
+                *dst++ = OP_RGB;
+                memcpy(dst, px, 3);
+                dst += 3;
+            }
+        }
+        memcpy(q->prev, px, 4);
+    }
+
+    return dst - start;
+}
+
+size_t doodle_qoi_end(doodle_qoi *q, uint8_t *dst) {
+    static const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+    uint8_t *start = dst;
+    dst = flush_run(q, dst);
+    memcpy(dst, end, sizeof end);
+    return dst + sizeof end - start;
+}
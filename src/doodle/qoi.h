@@ -0,0 +1,44 @@
+#ifndef DOODLE_QOI_H
+#define DOODLE_QOI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DOODLE_QOI_HEADER_SIZE 14
+// the most a row of width pixels can take, including a run left over from
+// the rows before
+#define DOODLE_QOI_ROW_MAX(width) (5 * (size_t)(width) + 1)
+// the most doodle_qoi_end writes
+#define DOODLE_QOI_END_MAX 9
+
+// A QOI encoder, fed rows of an image top to bottom. Each pixel is coded
+// against the one before it and a small table of recently seen colours in a
+// single pass, so encoding costs little more than copying.
+typedef struct {
+    uint8_t index[64][4];
+    uint8_t prev[4];
+    uint32_t run; // repeats of prev not yet written
+} doodle_qoi;
+
+// starts q and writes the header for a width x height RGBA image
+void doodle_qoi_start(
+    doodle_qoi *q, 
+    uint8_t *header, 
+    uint32_t width, 
+    uint32_t height
+);
+
+// encodes width pixels, 4 bytes each with transparency rather than opacity,
+// into dst and returns the bytes written
+size_t doodle_qoi_row(
+    doodle_qoi *q, 
+    uint8_t *dst, 
+    const uint8_t *src, 
+    uint32_t width
+);
+
+// writes what's left of the last run and the end marker, returns the bytes
+// written
+size_t doodle_qoi_end(doodle_qoi *q, uint8_t *dst);
+
+#endif
@@ -0,0 +1,557 @@
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+
+// Draws are packed back to back into fixed size chunks as variable length 
+// records, a tag byte followed by the draw's fields. Coordinates are stored 
+// as floats whenever that loses nothing, so replaying a queue reads a few 
+// contiguous blocks rather than chasing a node per draw.
+#define CHUNK_SIZE (64 * 1024)
+
+// a record with every coordinate stored as a double
+#define RECORD_WIDE 0x80
+#define RECORD_TYPE 0x7f
+
+// tag, four points and a thickness as doubles, a colour
+#define MAX_RECORD (1 + 5 * sizeof(double) + 4)
+
+typedef struct chunk {
+    struct chunk *next;
+    size_t used;
+    unsigned char data[CHUNK_SIZE];
+} chunk;
+
+struct doodle_queue {
+    chunk *root;
+    chunk *tail;
+    size_t length;
+    size_t chunks;
+    doodle_palette palette; // the colours of the draws pushed
+};
+
+doodle_queue *doodle_queue_new(void) {
+    doodle_queue *q = malloc(sizeof *q);
+    if (q == NULL) {
+        return NULL;
+    }
+
+    q->root = NULL;
+    q->tail = NULL;
+    q->length = 0;
+    q->chunks = 0;
+    doodle_palette_clear(&q->palette);
+
+    return q;
+}
+
+static void free_chunks(chunk *c) {
+    while (c != NULL) {
+        chunk *tmp = c;
+        c = c->next;
+        free(tmp);
+    }
+}
+
+void doodle_queue_free(doodle_queue *q) {
+    if (q == NULL) return;
+
+    free_chunks(q->root);
+    free(q);
+}
+
+void doodle_queue_clear(doodle_queue *q) {
+    if (q->root == NULL) return;
+
+    free_chunks(q->root->next);
+    q->root->next = NULL;
+    q->root->used = 0;
+    q->tail = q->root;
+    q->length = 0;
+    q->chunks = 1;
+    doodle_palette_clear(&q->palette);
+}
+
+static bool fits_float(double d) {
+    return fabs(d) <= FLT_MAX && (double)(float)d == d;
+}
+
+static unsigned char *put_coord(unsigned char *p, bool wide, double d) {
+    if (wide) {
+        memcpy(p, &d, sizeof d);
+        return p + sizeof d;
+    }
+    float f = (float)d;
+    memcpy(p, &f, sizeof f);
+    return p + sizeof f;
+}
+
+static const unsigned char *get_coord(
+    const unsigned char *p, 
+    bool wide, 
+    double *d
+) {
+    if (wide) {
+        memcpy(d, p, sizeof *d);
+        return p + sizeof *d;
+    }
+    float f;
+    memcpy(&f, p, sizeof f);
+    *d = f;
+    return p + sizeof f;
+}
+
+static unsigned char *put_bytes(
+    unsigned char *p, 
+    const void *src, 
+    size_t size
+) {
+    memcpy(p, src, size);
+    return p + size;
+}
+
+static const unsigned char *get_bytes(
+    const unsigned char *p, 
+    void *dst, 
+    size_t size
+) {
+    memcpy(dst, p, size);
+    return p + size;
+}
+
+static unsigned char *put_color(unsigned char *p, doodle_color c) {
+    uint8_t bytes[] = { c.r, c.g, c.b, c.a };
+    return put_bytes(p, bytes, sizeof bytes);
+}
+
+static const unsigned char *get_color(const unsigned char *p, doodle_color *c) {
+    *c = (doodle_color) { .r = p[0], .g = p[1], .b = p[2], .a = p[3] };
+    return p + 4;
+}
+
+// writes d's record to out, which has room for MAX_RECORD bytes, returning 
+// its length
+static size_t encode_draw(unsigned char *out, const doodle_draw *d) {
+    unsigned char *p = out + 1;
+    bool wide;
+
+    switch (d->type) {
+    case DOODLE_DRAW_RECT: {
+        const doodle_rect_draw *r = &d->params.rect;
+        wide = !fits_float(r->origin.x) || !fits_float(r->origin.y);
+        p = put_coord(p, wide, r->origin.x);
+        p = put_coord(p, wide, r->origin.y);
+        p = put_bytes(p, &r->width, sizeof r->width);
+        p = put_bytes(p, &r->height, sizeof r->height);
+        p = put_color(p, r->color);
+        break;
+    }
+    case DOODLE_DRAW_CIRCLE: {
+        const doodle_circle_draw *c = &d->params.circle;
+        wide = !fits_float(c->origin.x) || !fits_float(c->origin.y);
+        p = put_coord(p, wide, c->origin.x);
+        p = put_coord(p, wide, c->origin.y);
+        p = put_bytes(p, &c->radius, sizeof c->radius);
+        p = put_color(p, c->color);
+        break;
+    }
+    default: {
+        const doodle_line_draw *l = &d->params.line;
+        wide = !fits_float(l->p1.x) || !fits_float(l->p1.y) 
+            || !fits_float(l->p2.x) || !fits_float(l->p2.y) 
+            || !fits_float(l->thickness);
+        p = put_coord(p, wide, l->p1.x);
+        p = put_coord(p, wide, l->p1.y);
+        p = put_coord(p, wide, l->p2.x);
+        p = put_coord(p, wide, l->p2.y);
+        p = put_coord(p, wide, l->thickness);
+        p = put_color(p, l->color);
+        break;
+    }
+    }
+
+    out[0] = (unsigned char)d->type | (wide ? RECORD_WIDE : 0);
+    return (size_t)(p - out);
+}
+
+// reads the record at in into d, returning its length
+static size_t decode_draw(const unsigned char *in, doodle_draw *d) {
+    const unsigned char *p = in + 1;
+    bool wide = in[0] & RECORD_WIDE;
+
+    d->type = in[0] & RECORD_TYPE;
+    switch (d->type) {
+    case DOODLE_DRAW_RECT: {
+        doodle_rect_draw *r = &d->params.rect;
+        p = get_coord(p, wide, &r->origin.x);
+        p = get_coord(p, wide, &r->origin.y);
+        p = get_bytes(p, &r->width, sizeof r->width);
+        p = get_bytes(p, &r->height, sizeof r->height);
+        p = get_color(p, &r->color);
+        break;
+    }
+    case DOODLE_DRAW_CIRCLE: {
+        doodle_circle_draw *c = &d->params.circle;
+        p = get_coord(p, wide, &c->origin.x);
+        p = get_coord(p, wide, &c->origin.y);
+        p = get_bytes(p, &c->radius, sizeof c->radius);
+        p = get_color(p, &c->color);
+        break;
+    }
+    default: {
+        doodle_line_draw *l = &d->params.line;
+        p = get_coord(p, wide, &l->p1.x);
+        p = get_coord(p, wide, &l->p1.y);
+        p = get_coord(p, wide, &l->p2.x);
+        p = get_coord(p, wide, &l->p2.y);
+        p = get_coord(p, wide, &l->thickness);
+        p = get_color(p, &l->color);
+        break;
+    }
+    }
+
+    return (size_t)(p - in);
+}
+
+bool doodle_queue_push(doodle_queue *q, const doodle_draw *d) {
+    if (q->tail == NULL || CHUNK_SIZE - q->tail->used < MAX_RECORD) {
+        chunk *c = malloc(sizeof *c);
+        if (c == NULL) {
+            return false;
+        }
+        c->next = NULL;
+        c->used = 0;
+
+        if (q->root == NULL) {
+            q->root = c;
+        } else {
+            q->tail->next = c;
+        }
+        q->tail = c;
+        q->chunks++;
+    }
+
+    q->tail->used += encode_draw(q->tail->data + q->tail->used, d);
+    q->length++;
+    doodle_palette_add(&q->palette, doodle_draw_color(d));
+
+    return true;
+}
+
+size_t doodle_queue_length(const doodle_queue *q) {
+    return q->length;
+}
+
+const doodle_palette *doodle_queue_palette(const doodle_queue *q) {
+    return &q->palette;
+}
+
+size_t doodle_queue_bytes(const doodle_queue *q) {
+    return sizeof *q + q->chunks * sizeof(chunk);
+}
+
+static bool colors_equal(doodle_color a, doodle_color b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+static bool points_equal(doodle_point a, doodle_point b) {
+    return a.x == b.x && a.y == b.y;
+}
+
+static bool draws_equal(const doodle_draw *a, const doodle_draw *b) {
+    if (a->type != b->type) return false;
+
+    switch (a->type) {
+    case DOODLE_DRAW_RECT:
+        return points_equal(a->params.rect.origin, b->params.rect.origin)
+            && a->params.rect.width == b->params.rect.width
+            && a->params.rect.height == b->params.rect.height
+            && colors_equal(a->params.rect.color, b->params.rect.color);
+    case DOODLE_DRAW_CIRCLE:
+        return points_equal(a->params.circle.origin, b->params.circle.origin)
+            && a->params.circle.radius == b->params.circle.radius
+            && colors_equal(a->params.circle.color, b->params.circle.color);
+    case DOODLE_DRAW_LINE:
+        return points_equal(a->params.line.p1, b->params.line.p1)
+            && points_equal(a->params.line.p2, b->params.line.p2)
+            && a->params.line.thickness == b->params.line.thickness
+            && colors_equal(a->params.line.color, b->params.line.color);
+    }
+    return false;
+}
+
+// FNV-1a over the fields compared by draws_equal
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ bytes[i]) * 1099511628211u;
+    }
+    return h;
+}
+
+static uint64_t hash_double(uint64_t h, double d) {
+    d += 0.0; // -0.0 == 0.0
+    return hash_bytes(h, &d, sizeof d);
+}
+
+static uint64_t hash_color(uint64_t h, doodle_color c) {
+    uint8_t bytes[] = { c.r, c.g, c.b, c.a };
+    return hash_bytes(h, bytes, sizeof bytes);
+}
+
+static uint64_t hash_draw(const doodle_draw *d) {
+    uint64_t h = hash_bytes(14695981039346656037u, &d->type, sizeof d->type);
+
+    switch (d->type) {
+    case DOODLE_DRAW_RECT:
+        h = hash_double(h, d->params.rect.origin.x);
+        h = hash_double(h, d->params.rect.origin.y);
+        h = hash_bytes(h, &d->params.rect.width, sizeof d->params.rect.width);
+        h = hash_bytes(h, &d->params.rect.height, sizeof d->params.rect.height);
+        return hash_color(h, d->params.rect.color);
+    case DOODLE_DRAW_CIRCLE:
+        h = hash_double(h, d->params.circle.origin.x);
+        h = hash_double(h, d->params.circle.origin.y);
+        h = hash_bytes(
+            h, &d->params.circle.radius, sizeof d->params.circle.radius
+        );
+        return hash_color(h, d->params.circle.color);
+    case DOODLE_DRAW_LINE:
+        h = hash_double(h, d->params.line.p1.x);
+        h = hash_double(h, d->params.line.p1.y);
+        h = hash_double(h, d->params.line.p2.x);
+        h = hash_double(h, d->params.line.p2.y);
+        h = hash_double(h, d->params.line.thickness);
+        return hash_color(h, d->params.line.color);
+    }
+    return h;
+}
+
+// A rectangle covers exactly its bounds, so it's rewritten as those bounds 
+// with an integer origin, sparing the primitive any clamping.
+static void region_to_rect(doodle_region b, doodle_rect_draw *r) {
+    r->origin = (doodle_point) { .x = b.x0, .y = b.y0 };
+    r->width = b.x1 - b.x0 - 1;
+    r->height = b.y1 - b.y0 - 1;
+}
+
+static int by_rows(const void *a, const void *b) {
+    const doodle_region *ra = a;
+    const doodle_region *rb = b;
+    if (ra->y0 != rb->y0) return ra->y0 < rb->y0 ? -1 : 1;
+    if (ra->y1 != rb->y1) return ra->y1 < rb->y1 ? -1 : 1;
+    if (ra->x0 != rb->x0) return ra->x0 < rb->x0 ? -1 : 1;
+    return 0;
+}
+
+static int by_columns(const void *a, const void *b) {
+    const doodle_region *ra = a;
+    const doodle_region *rb = b;
+    if (ra->x0 != rb->x0) return ra->x0 < rb->x0 ? -1 : 1;
+    if (ra->x1 != rb->x1) return ra->x1 < rb->x1 ? -1 : 1;
+    if (ra->y0 != rb->y0) return ra->y0 < rb->y0 ? -1 : 1;
+    return 0;
+}
+
+// Merges regions that share their rows and touch or overlap across them, 
+// then those sharing columns that touch or overlap down them. Returns the 
+// number left at the front of rs.
+static size_t merge_regions(doodle_region *rs, size_t count) {
+    qsort(rs, count, sizeof *rs, by_rows);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        doodle_region *last = kept > 0 ? &rs[kept - 1] : NULL;
+        if (last != NULL && last->y0 == rs[i].y0 && last->y1 == rs[i].y1 
+            && rs[i].x0 <= last->x1
+        ) {
+            if (rs[i].x1 > last->x1) last->x1 = rs[i].x1;
+        } else {
+            rs[kept++] = rs[i];
+        }
+    }
+
+    count = kept;
+    qsort(rs, count, sizeof *rs, by_columns);
+    kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        doodle_region *last = kept > 0 ? &rs[kept - 1] : NULL;
+        if (last != NULL && last->x0 == rs[i].x0 && last->x1 == rs[i].x1 
+            && rs[i].y0 <= last->y1
+        ) {
+            if (rs[i].y1 > last->y1) last->y1 = rs[i].y1;
+        } else {
+            rs[kept++] = rs[i];
+        }
+    }
+
+    return kept;
+}
+
+// Within a run of same coloured rectangles with nothing drawn between them 
+// order doesn't matter, so the run can be replaced by any set of rectangles 
+// covering the same pixels. Returns how many of the run's draws are needed.
+static size_t merge_rect_run(
+    doodle_draw *run, 
+    size_t count, 
+    doodle_region *scratch, 
+    uint32_t width, 
+    uint32_t height
+) {
+    for (size_t i = 0; i < count; i++) {
+        doodle_draw_bounds(&run[i], width, height, &scratch[i]);
+    }
+
+    size_t kept = merge_regions(scratch, count);
+    for (size_t i = 0; i < kept; i++) {
+        region_to_rect(scratch[i], &run[i].params.rect);
+    }
+
+    return kept;
+}
+
+static bool same_rect_color(const doodle_draw *a, const doodle_draw *b) {
+    return a->type == DOODLE_DRAW_RECT && b->type == DOODLE_DRAW_RECT
+        && colors_equal(a->params.rect.color, b->params.rect.color);
+}
+
+// the duplicate table is kept at most half full
+static size_t optimize_slots(const doodle_queue *q) {
+    size_t slot_count = 1;
+    while (slot_count < q->length * 2) slot_count *= 2;
+    return slot_count;
+}
+
+size_t doodle_queue_optimize_bytes(const doodle_queue *q) {
+    // the packed survivors are never bigger than the queue they came from
+    return (q->length + 1) * (sizeof(doodle_draw) + sizeof(doodle_region))
+        + optimize_slots(q) * sizeof(const doodle_draw *)
+        + doodle_queue_bytes(q);
+}
+
+// The records are variable length and can't be edited in place, so the 
+// optimizer works on the unpacked draws and packs the survivors into fresh 
+// chunks, replacing the old ones only once that has succeeded.
+bool doodle_queue_optimize(
+    doodle_queue *q, 
+    uint32_t width, 
+    uint32_t height, 
+    doodle_queue_stats *stats
+) {
+    *stats = (doodle_queue_stats) { 0 };
+
+    size_t slot_count = optimize_slots(q);
+
+    doodle_draw *draws = malloc((q->length + 1) * sizeof *draws);
+    const doodle_draw **slots = calloc(slot_count, sizeof *slots);
+    doodle_region *scratch = malloc((q->length + 1) * sizeof *scratch);
+    if (draws == NULL || slots == NULL || scratch == NULL) {
+        free(draws);
+        free(slots);
+        free(scratch);
+        return false;
+    }
+
+    size_t count = 0;
+    doodle_queue_iter it = doodle_queue_begin(q);
+    while (doodle_queue_next(&it, &draws[count])) count++;
+
+    // Walking back to front, a draw that can't touch the image or that is 
+    // repeated identically later on can't change the result. Survivors are 
+    // packed towards the end of draws, behind the walk.
+    size_t front = count;
+    for (size_t i = count; i-- > 0;) {
+        doodle_region b;
+        if (!doodle_draw_bounds(&draws[i], width, height, &b)) {
+            stats->culled++;
+            continue;
+        }
+
+        if (draws[i].type == DOODLE_DRAW_RECT) {
+            region_to_rect(b, &draws[i].params.rect);
+        }
+
+        size_t slot = hash_draw(&draws[i]) & (slot_count - 1);
+        while (slots[slot] != NULL) {
+            if (draws_equal(slots[slot], &draws[i])) break;
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        if (slots[slot] != NULL) {
+            stats->duplicates++;
+            continue;
+        }
+
+        draws[--front] = draws[i];
+        slots[slot] = &draws[front];
+    }
+
+    memmove(draws, draws + front, (count - front) * sizeof *draws);
+    count -= front;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < count;) {
+        size_t end = i + 1;
+        while (end < count && same_rect_color(&draws[i], &draws[end])) {
+            end++;
+        }
+
+        size_t used = end - i;
+        if (used > 1) {
+            used = merge_rect_run(draws + i, end - i, scratch, width, height);
+            stats->merged += end - i - used;
+        }
+
+        memmove(draws + kept, draws + i, used * sizeof *draws);
+        kept += used;
+        i = end;
+    }
+
+    doodle_queue packed = { 
+        .root = NULL, 
+        .tail = NULL, 
+        .length = 0, 
+        .chunks = 0,
+    };
+    // the palette is rebuilt from the draws that are left
+    doodle_palette_clear(&packed.palette);
+    bool ok = true;
+    for (size_t i = 0; ok && i < kept; i++) {
+        ok = doodle_queue_push(&packed, &draws[i]);
+    }
+
+    if (ok) {
+        free_chunks(q->root);
+        *q = packed;
+    } else {
+        free_chunks(packed.root);
+        *stats = (doodle_queue_stats) { 0 };
+    }
+
+    free(draws);
+    free(slots);
+    free(scratch);
+    return ok;
+}
+
+doodle_queue_iter doodle_queue_begin(const doodle_queue *q) {
+    return (doodle_queue_iter) { .chunk = q->root, .offset = 0 };
+}
+
+bool doodle_queue_next(doodle_queue_iter *it, doodle_draw *d) {
+    const chunk *c = it->chunk;
+    if (c != NULL && it->offset == c->used) {
+        c = c->next;
+        it->chunk = c;
+        it->offset = 0;
+    }
+    if (c == NULL) {
+        return false;
+    }
+
+    it->offset += decode_draw(c->data + it->offset, d);
+    return true;
+}
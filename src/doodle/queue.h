@@ -0,0 +1,46 @@
+#ifndef DOODLE_QUEUE_H
+#define DOODLE_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "doodle.h"
+
+typedef struct doodle_queue doodle_queue;
+
+// read position in a queue, any number may walk the same queue at once
+typedef struct {
+    const void *chunk;
+    size_t offset;
+} doodle_queue_iter;
+
+doodle_queue *doodle_queue_new(void);
+void doodle_queue_free(doodle_queue *q);
+
+// empties q, keeping its first chunk for the draws pushed next
+void doodle_queue_clear(doodle_queue *q);
+
+bool doodle_queue_push(doodle_queue *q, const doodle_draw *d);
+size_t doodle_queue_length(const doodle_queue *q);
+// the colours of the draws in q
+const doodle_palette *doodle_queue_palette(const doodle_queue *q);
+// memory held by q
+size_t doodle_queue_bytes(const doodle_queue *q);
+
+// Drops draws that can't change a width x height image and merges runs of 
+// same coloured rectangles, false if it ran out of memory, in which case the
+// queue is left as it was.
+bool doodle_queue_optimize(
+    doodle_queue *q, 
+    uint32_t width, 
+    uint32_t height, 
+    doodle_queue_stats *stats
+);
+
+// memory doodle_queue_optimize takes while it runs, on top of q itself
+size_t doodle_queue_optimize_bytes(const doodle_queue *q);
+
+doodle_queue_iter doodle_queue_begin(const doodle_queue *q);
+bool doodle_queue_next(doodle_queue_iter *it, doodle_draw *d);
+
+#endif
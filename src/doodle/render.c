@@ -0,0 +1,744 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "render.h"
+#include "workers.h"
+
+// bands shorter than this aren't worth a thread
+#define MIN_BAND_HEIGHT 16
+
+#define DEFAULT_TILE_SIZE 64
+
+
+// A band is replayed from the queue front to back, or when culling from the
+// draws array back to front beneath coverage.
+typedef struct {
+    doodle_image *img;
+    const doodle_queue *queue;
+    const doodle_draw *draws;
+    size_t draw_count;
+    doodle_coverage *coverage;
+    doodle_region band;
+} band_job;
+
+// draws touching each tile, as indices into draws, kept in queue order
+typedef struct {
+    doodle_draw *draws;
+    size_t *offsets;
+    uint32_t *indices;
+    uint32_t tiles_x, tiles_y;
+    uint32_t tile_size;
+} tile_bins;
+
+// tiles [next, end) of a worker's share, next is claimed atomically so idle 
+// workers can steal from the others
+typedef struct {
+    uint32_t next;
+    uint32_t end;
+} tile_range;
+
+typedef struct {
+    doodle_image *img;
+    const tile_bins *bins;
+    tile_range *ranges;
+    uint32_t workers;
+    uint32_t width, height;
+} tile_pool;
+
+typedef struct {
+    tile_pool *pool;
+    uint32_t id;
+} tile_job;
+
+static void render_region(
+    doodle_image *img, 
+    const doodle_queue *q, 
+    doodle_region clip
+) {
+    doodle_queue_iter it = doodle_queue_begin(q);
+    doodle_draw d;
+    while (doodle_queue_next(&it, &d)) {
+        doodle_draw_clipped(img, &d, clip);
+    }
+}
+
+static void *render_band(void *data) {
+    band_job *job = data;
+
+    if (job->coverage == NULL) {
+        render_region(job->img, job->queue, job->band);
+        return NULL;
+    }
+
+    for (size_t i = job->draw_count; i-- > 0;) {
+        doodle_draw_beneath(job->img, &job->draws[i], job->band, job->coverage);
+    }
+    return NULL;
+}
+
+// copies the queue into an array, for random or reverse access
+static doodle_draw *queue_array(const doodle_queue *q) {
+    doodle_draw *draws = malloc((doodle_queue_length(q) + 1) * sizeof *draws);
+    if (draws == NULL) {
+        return NULL;
+    }
+
+    doodle_queue_iter it = doodle_queue_begin(q);
+    for (size_t i = 0; doodle_queue_next(&it, &draws[i]); i++);
+
+    return draws;
+}
+
+// Each worker replays the whole queue clipped to its own band of rows, so 
+// painter's order holds within every band and no pixel is shared between 
+// workers. Every draw is an opaque overwrite, so when culling the queue is 
+// instead replayed back to front and only the pixels no later draw covers
+// are written. Coverage rows are whole words, so bands can share it. Only the
+// rows img holds are split up, so it may itself be a band of the image.
+static bool render_bands(
+    doodle_image *img, 
+    const doodle_queue *q, 
+    const doodle_config *conf,
+    bool cull
+) {
+    doodle_region held = doodle_image_region(img);
+    uint32_t height = held.y1 - held.y0;
+
+    uint32_t bands = doodle_thread_count(conf);
+    uint32_t max_bands = (height + MIN_BAND_HEIGHT - 1) / MIN_BAND_HEIGHT;
+    if (bands > max_bands) bands = max_bands;
+    if (bands == 0) bands = 1;
+
+    doodle_draw *draws = NULL;
+    doodle_coverage *coverage = NULL;
+    if (cull) {
+        draws = queue_array(q);
+        coverage = doodle_coverage_new(conf->width, conf->height);
+    }
+
+    band_job *jobs = malloc(bands * sizeof *jobs);
+    if (jobs == NULL || (cull && (draws == NULL || coverage == NULL))) {
+        free(jobs);
+        free(draws);
+        free(coverage);
+        return false;
+    }
+
+    uint32_t band_height = (height + bands - 1) / bands;
+    for (uint32_t i = 0; i < bands; i++) {
+        uint32_t y0 = held.y0 + i * band_height;
+        uint32_t y1 = y0 + band_height;
+        jobs[i] = (band_job) {
+            .img = img,
+            .queue = q,
+            .draws = draws,
+            .draw_count = doodle_queue_length(q),
+            .coverage = coverage,
+            .band = {
+                .x0 = 0,
+                .y0 = y0 < held.y1 ? y0 : held.y1,
+                .x1 = conf->width,
+                .y1 = y1 < held.y1 ? y1 : held.y1
+            }
+        };
+    }
+
+    doodle_run_workers(render_band, jobs, sizeof *jobs, bands);
+
+    free(jobs);
+    free(draws);
+    free(coverage);
+    return true;
+}
+
+static void free_bins(tile_bins *bins) {
+    free(bins->draws);
+    free(bins->offsets);
+    free(bins->indices);
+}
+
+// Visits each tile draw i touches, a row of tiles at a time, and returns how
+// many it touched. Without slots that's all, without indices the draw is only
+// counted against each tile, otherwise it's written to the tile's next slot.
+static size_t bin_draw(
+    const tile_bins *bins, 
+    const doodle_draw *d, 
+    size_t i, 
+    const doodle_config *conf, 
+    size_t *slots,
+    uint32_t *indices
+) {
+    uint32_t size = bins->tile_size;
+
+    doodle_region all;
+    if (!doodle_draw_bounds(d, conf->width, conf->height, &all)) {
+        return 0;
+    }
+
+    size_t touched = 0;
+    for (uint32_t ty = all.y0 / size; ty <= (all.y1 - 1) / size; ty++) {
+        doodle_region b;
+        if (!doodle_draw_band_bounds(
+                d, conf->width, conf->height, 
+                ty * size, (ty + 1) * size, &b
+            )
+        ) {
+            continue;
+        }
+        for (uint32_t tx = b.x0 / size; tx <= (b.x1 - 1) / size; tx++) {
+            size_t tile = (size_t)ty * bins->tiles_x + tx;
+            touched++;
+            if (slots == NULL) {
+                continue;
+            } else if (indices == NULL) {
+                slots[tile]++;
+            } else {
+                indices[slots[tile]++] = i;
+            }
+        }
+    }
+    return touched;
+}
+
+// sizes the grid of tiles over the canvas, returning how many tiles it has
+static size_t tile_grid(tile_bins *bins, const doodle_config *conf) {
+    uint32_t size = bins->tile_size;
+    bins->tiles_x = (conf->width + size - 1) / size;
+    bins->tiles_y = (conf->height + size - 1) / size;
+    return (size_t)bins->tiles_x * bins->tiles_y;
+}
+
+// Assigns every draw to the tiles its bounding box touches, as a compact 
+// index list per tile. Draws that can't touch the image aren't binned.
+static bool bin_draws(
+    tile_bins *bins, 
+    const doodle_queue *q, 
+    const doodle_config *conf
+) {
+    size_t tile_count = tile_grid(bins, conf);
+    size_t draw_count = doodle_queue_length(q);
+
+    bins->draws = queue_array(q);
+    bins->offsets = calloc(tile_count + 1, sizeof *bins->offsets);
+    bins->indices = NULL;
+    if (bins->draws == NULL || bins->offsets == NULL) {
+        return false;
+    }
+
+    // first pass counts the draws in each tile
+    for (size_t i = 0; i < draw_count; i++) {
+        bin_draw(bins, &bins->draws[i], i, conf, bins->offsets + 1, NULL);
+    }
+
+    for (size_t t = 0; t < tile_count; t++) {
+        bins->offsets[t + 1] += bins->offsets[t];
+    }
+
+    bins->indices = malloc(bins->offsets[tile_count] * sizeof *bins->indices);
+    size_t *fill = malloc(tile_count * sizeof *fill);
+    if (bins->indices == NULL || fill == NULL) {
+        free(fill);
+        return false;
+    }
+
+    // second pass writes each draw's index into its tiles
+    memcpy(fill, bins->offsets, tile_count * sizeof *fill);
+    for (size_t i = 0; i < draw_count; i++) {
+        bin_draw(bins, &bins->draws[i], i, conf, fill, bins->indices);
+    }
+
+    free(fill);
+    return true;
+}
+
+static void render_tile(tile_pool *pool, uint32_t tile) {
+    const tile_bins *bins = pool->bins;
+    uint32_t tx = tile % bins->tiles_x;
+    uint32_t ty = tile / bins->tiles_x;
+
+    doodle_region clip = {
+        .x0 = tx * bins->tile_size,
+        .y0 = ty * bins->tile_size,
+        .x1 = (tx + 1) * bins->tile_size,
+        .y1 = (ty + 1) * bins->tile_size,
+    };
+    if (clip.x1 > pool->width) clip.x1 = pool->width;
+    if (clip.y1 > pool->height) clip.y1 = pool->height;
+
+    for (size_t i = bins->offsets[tile]; i < bins->offsets[tile + 1]; i++) {
+        doodle_draw_clipped(pool->img, &bins->draws[bins->indices[i]], clip);
+    }
+}
+
+// works through its own share of tiles, then steals from the other workers
+static void *render_tiles(void *data) {
+    tile_job *job = data;
+    tile_pool *pool = job->pool;
+
+    for (uint32_t i = 0; i < pool->workers; i++) {
+        tile_range *range = &pool->ranges[(job->id + i) % pool->workers];
+        uint32_t tile;
+        while (
+            (tile = __atomic_fetch_add(&range->next, 1, __ATOMIC_RELAXED)) 
+            < range->end
+        ) {
+            render_tile(pool, tile);
+        }
+    }
+
+    return NULL;
+}
+
+// Draws are binned into square tiles which are then rasterized one at a 
+// time, so a tile stays in cache while all of its draws are applied.
+static bool render_binned(
+    doodle_image *img, 
+    const doodle_queue *q, 
+    const doodle_config *conf
+) {
+    tile_bins bins = {
+        .tile_size = conf->tile_size ? conf->tile_size : DEFAULT_TILE_SIZE
+    };
+    if (!bin_draws(&bins, q, conf)) {
+        free_bins(&bins);
+        return false;
+    }
+
+    uint32_t tile_count = bins.tiles_x * bins.tiles_y;
+    uint32_t workers = doodle_thread_count(conf);
+    if (workers > tile_count) workers = tile_count;
+    if (workers == 0) workers = 1;
+
+    tile_range *ranges = malloc(workers * sizeof *ranges);
+    tile_job *jobs = malloc(workers * sizeof *jobs);
+    if (ranges == NULL || jobs == NULL) {
+        free(ranges);
+        free(jobs);
+        free_bins(&bins);
+        return false;
+    }
+
+    tile_pool pool = {
+        .img = img,
+        .bins = &bins,
+        .ranges = ranges,
+        .workers = workers,
+        .width = conf->width,
+        .height = conf->height,
+    };
+
+    uint32_t share = (tile_count + workers - 1) / workers;
+    for (uint32_t i = 0; i < workers; i++) {
+        uint32_t start = i * share;
+        uint32_t end = start + share;
+        ranges[i] = (tile_range) {
+            .next = start < tile_count ? start : tile_count,
+            .end = end < tile_count ? end : tile_count,
+        };
+        jobs[i] = (tile_job) { .pool = &pool, .id = i };
+    }
+
+    doodle_run_workers(render_tiles, jobs, sizeof *jobs, workers);
+
+    free(ranges);
+    free(jobs);
+    free_bins(&bins);
+    return true;
+}
+
+size_t doodle_render_bytes(
+    const doodle_queue *q, 
+    const doodle_config *conf
+) {
+    size_t draws = (doodle_queue_length(q) + 1) * sizeof(doodle_draw);
+
+    switch (conf->render) {
+    case DOODLE_RENDER_TILES: {
+        tile_bins bins = {
+            .tile_size = conf->tile_size ? conf->tile_size : DEFAULT_TILE_SIZE
+        };
+        size_t tile_count = tile_grid(&bins, conf);
+
+        // the indices are only known by visiting every draw's tiles
+        size_t indices = 0;
+        doodle_draw d;
+        doodle_queue_iter it = doodle_queue_begin(q);
+        while (doodle_queue_next(&it, &d)) {
+            indices += bin_draw(&bins, &d, 0, conf, NULL, NULL);
+        }
+
+        return draws + (2 * tile_count + 1) * sizeof(size_t) 
+            + indices * sizeof(uint32_t);
+    }
+    case DOODLE_RENDER_CULLED:
+        return draws + doodle_coverage_size(conf->width, conf->height);
+    case DOODLE_RENDER_BANDS:
+        break;
+    }
+    return 0;
+}
+
+void doodle_render(
+    doodle_image *img, 
+    const doodle_queue *q, 
+    const doodle_config *conf
+) {
+    doodle_image_add_colors(img, doodle_queue_palette(q));
+
+    // binning and culling need memory proportional to the queue or image, 
+    // if it can't be had the plain bands still work
+    switch (conf->render) {
+    case DOODLE_RENDER_TILES:
+        if (render_binned(img, q, conf)) return;
+        break;
+    case DOODLE_RENDER_CULLED:
+        if (render_bands(img, q, conf, true)) return;
+        break;
+    case DOODLE_RENDER_BANDS:
+        break;
+    }
+
+    if (!render_bands(img, q, conf, false)) {
+        doodle_region full = {
+            .x0 = 0, 
+            .y0 = 0, 
+            .x1 = conf->width, 
+            .y1 = conf->height
+        };
+        render_region(img, q, full);
+    }
+}
+
+typedef struct {
+    doodle_writer *writer;
+    doodle_image *band;
+    bool written;
+} encode_job;
+
+static void *encode_band(void *data) {
+    encode_job *job = data;
+    job->written = doodle_writer_rows(job->writer, job->band);
+    return NULL;
+}
+
+// Two bands take turns, one is encoded on its own thread while the workers
+// render the next, so the encoder only holds up rendering when it's slower.
+bool doodle_render_streamed(
+    const doodle_queue *q, 
+    const doodle_config *conf, 
+    FILE *out
+) {
+    uint32_t rows = conf->band_height > 0 ? conf->band_height : conf->height;
+
+    // the writer needs every colour up front, before any band is drawn
+    doodle_palette palette;
+    doodle_palette_clear(&palette);
+    doodle_palette_add(&palette, conf->background);
+    doodle_palette_merge(&palette, doodle_queue_palette(q));
+
+    doodle_image *bands[2] = {
+        doodle_band_new(conf, rows),
+        doodle_band_new(conf, rows),
+    };
+    doodle_writer *w = NULL;
+    if (bands[0] == NULL || bands[1] == NULL
+        || (w = doodle_writer_new(conf, &palette, out)) == NULL
+    ) {
+        free(bands[0]);
+        free(bands[1]);
+        return false;
+    }
+
+    encode_job job = { .writer = w, .written = true };
+    pthread_t encoder;
+    bool encoding = false;
+
+    // job belongs to the encoder from when it's started until it's joined
+    for (uint32_t y = 0, i = 0; y < conf->height; i ^= 1) {
+        doodle_image *band = bands[i];
+        doodle_band_move(band, conf, y);
+        if (!render_bands(band, q, conf, false)) {
+            render_region(band, q, doodle_image_region(band));
+        }
+        y = doodle_image_region(band).y1;
+
+        if (encoding) {
+            pthread_join(encoder, NULL);
+            encoding = false;
+        }
+        if (!job.written) {
+            break;
+        }
+
+        job.band = band;
+        encoding = pthread_create(&encoder, NULL, encode_band, &job) == 0;
+        if (!encoding) {
+            encode_band(&job);
+        }
+    }
+    if (encoding) {
+        pthread_join(encoder, NULL);
+    }
+
+    bool written = doodle_writer_end(w) && job.written;
+    free(bands[0]);
+    free(bands[1]);
+    return written;
+}
+
+struct doodle_scene {
+    tile_bins bins;
+    uint32_t width, height;
+    doodle_color background;
+};
+
+doodle_scene *doodle_scene_new(
+    const doodle_queue *q, 
+    const doodle_config *conf
+) {
+    doodle_scene *s = malloc(sizeof *s);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    *s = (doodle_scene) {
+        .bins.tile_size = conf->tile_size ? conf->tile_size : DEFAULT_TILE_SIZE,
+        .width = conf->width,
+        .height = conf->height,
+        .background = conf->background,
+    };
+    if (!bin_draws(&s->bins, q, conf)) {
+        doodle_scene_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void doodle_scene_free(doodle_scene *s) {
+    if (s == NULL) return;
+
+    free_bins(&s->bins);
+    free(s);
+}
+
+static int compare_indices(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// The tiles [t0, t1) under the span [lo, hi) of a canvas limit pixels long,
+// taken pad pixels wider each way so rounding a scaled draw can't carry it
+// past the draws found.
+static void tile_span(
+    double lo, 
+    double hi, 
+    double pad, 
+    uint32_t limit, 
+    uint32_t size, 
+    uint32_t *t0, 
+    uint32_t *t1
+) {
+    lo = fmax(0, floor(lo - pad));
+    hi = fmin(limit, ceil(hi + pad));
+    if (hi <= lo) {
+        *t0 = *t1 = 0;
+        return;
+    }
+    *t0 = lo / size;
+    *t1 = (hi - 1) / size + 1;
+}
+
+// The draws binned in the tiles the viewport sees, sorted back into queue
+// order with those in more than one tile kept once. Returns the count, or
+// SIZE_MAX if there wasn't memory.
+static size_t visible_draws(
+    const doodle_scene *s, 
+    const doodle_viewport *v, 
+    uint32_t **visible
+) {
+    const tile_bins *bins = &s->bins;
+    // a scaled length rounds by up to half a pixel of the viewport
+    double pad = 1 + 1 / v->scale;
+    uint32_t tx0, tx1, ty0, ty1;
+    tile_span(
+        v->x, v->x + v->width / v->scale, pad, s->width, bins->tile_size, 
+        &tx0, &tx1
+    );
+    tile_span(
+        v->y, v->y + v->height / v->scale, pad, s->height, bins->tile_size, 
+        &ty0, &ty1
+    );
+
+    size_t count = 0;
+    for (uint32_t ty = ty0; ty < ty1; ty++) {
+        size_t row = (size_t)ty * bins->tiles_x;
+        count += bins->offsets[row + tx1] - bins->offsets[row + tx0];
+    }
+
+    *visible = malloc((count + 1) * sizeof **visible);
+    if (*visible == NULL) {
+        return SIZE_MAX;
+    }
+
+    size_t n = 0;
+    for (uint32_t ty = ty0; ty < ty1; ty++) {
+        size_t row = (size_t)ty * bins->tiles_x;
+        size_t start = bins->offsets[row + tx0];
+        size_t end = bins->offsets[row + tx1];
+        memcpy(*visible + n, bins->indices + start, 
+            (end - start) * sizeof **visible);
+        n += end - start;
+    }
+
+    qsort(*visible, n, sizeof **visible, compare_indices);
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (kept == 0 || (*visible)[kept - 1] != (*visible)[i]) {
+            (*visible)[kept++] = (*visible)[i];
+        }
+    }
+    return kept;
+}
+
+// The canvas magnified by the viewport's scale and moved by the fraction of
+// a pixel the viewport starts into, so the viewport begins on a whole pixel
+// of it. At a scale of 1 from whole pixels it's the canvas itself, and the
+// viewport matches the same part of a whole render exactly.
+typedef struct {
+    double scale;
+    double shift_x, shift_y;
+    uint32_t width, height;
+    int64_t x0, y0; // the viewport's first pixel
+} view_canvas;
+
+static uint32_t scale_length(double length, double scale) {
+    double scaled = round(length * scale);
+    return scaled < UINT32_MAX ? scaled : UINT32_MAX;
+}
+
+static bool view_canvas_new(
+    const doodle_scene *s, 
+    const doodle_viewport *v, 
+    view_canvas *c
+) {
+    double x = v->x * v->scale;
+    double y = v->y * v->scale;
+    // far enough out that no pixel offset could reach the canvas
+    if (!(fabs(x) < 0x1p62) || !(fabs(y) < 0x1p62)) {
+        return false;
+    }
+
+    *c = (view_canvas) {
+        .scale = v->scale,
+        .shift_x = x - floor(x),
+        .shift_y = y - floor(y),
+        .width = scale_length(s->width, v->scale),
+        .height = scale_length(s->height, v->scale),
+        .x0 = floor(x),
+        .y0 = floor(y),
+    };
+    return true;
+}
+
+static doodle_point view_point(doodle_point p, const view_canvas *c) {
+    return (doodle_point) {
+        .x = p.x * c->scale - c->shift_x,
+        .y = p.y * c->scale - c->shift_y,
+    };
+}
+
+// moves d onto the view canvas
+static void view_draw(doodle_draw *d, const view_canvas *c) {
+    switch (d->type) {
+    case DOODLE_DRAW_RECT:
+        d->params.rect.origin = view_point(d->params.rect.origin, c);
+        d->params.rect.width = scale_length(d->params.rect.width, c->scale);
+        d->params.rect.height = scale_length(d->params.rect.height, c->scale);
+        break;
+    case DOODLE_DRAW_CIRCLE:
+        d->params.circle.origin = view_point(d->params.circle.origin, c);
+        d->params.circle.radius = scale_length(
+            d->params.circle.radius, c->scale
+        );
+        break;
+    case DOODLE_DRAW_LINE:
+        d->params.line.p1 = view_point(d->params.line.p1, c);
+        d->params.line.p2 = view_point(d->params.line.p2, c);
+        d->params.line.thickness *= c->scale;
+        break;
+    }
+}
+
+// the pixels of the view canvas under the viewport, false if it's off the
+// canvas and all background
+static bool view_clip(
+    const view_canvas *c, 
+    const doodle_viewport *v, 
+    doodle_region *clip
+) {
+    int64_t x0 = c->x0 > 0 ? c->x0 : 0;
+    int64_t y0 = c->y0 > 0 ? c->y0 : 0;
+    int64_t x1 = c->x0 + v->width < c->width ? c->x0 + v->width : c->width;
+    int64_t y1 = c->y0 + v->height < c->height 
+        ? c->y0 + v->height 
+        : c->height;
+    if (x0 >= x1 || y0 >= y1) {
+        return false;
+    }
+
+    *clip = (doodle_region) { .x0 = x0, .y0 = y0, .x1 = x1, .y1 = y1 };
+    return true;
+}
+
+bool doodle_render_viewport(
+    const doodle_scene *s, 
+    const doodle_viewport *v, 
+    doodle_image **img
+) {
+    view_canvas c;
+    if (!(v->scale > 0) || !isfinite(v->scale) || !view_canvas_new(s, v, &c)) {
+        return false;
+    }
+
+    doodle_config conf = {
+        .width = v->width,
+        .height = v->height,
+        .background = s->background,
+    };
+    doodle_image *renewed = doodle_renew(*img, &conf);
+    if (renewed == NULL) {
+        return false;
+    }
+    *img = renewed;
+
+    doodle_region clip;
+    if (!view_clip(&c, v, &clip)) {
+        return true;
+    }
+
+    uint32_t *visible;
+    size_t count = visible_draws(s, v, &visible);
+    if (count == SIZE_MAX) {
+        return false;
+    }
+
+    doodle_palette palette;
+    doodle_palette_clear(&palette);
+    for (size_t i = 0; i < count; i++) {
+        doodle_draw d = s->bins.draws[visible[i]];
+        view_draw(&d, &c);
+        doodle_draw_window(*img, &d, c.width, c.height, c.x0, c.y0, clip);
+        doodle_palette_add(&palette, doodle_draw_color(&d));
+    }
+    doodle_image_add_colors(*img, &palette);
+
+    free(visible);
+    return true;
+}
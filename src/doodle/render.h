@@ -0,0 +1,60 @@
+#ifndef DOODLE_RENDER_H
+#define DOODLE_RENDER_H
+
+#include "doodle.h"
+#include "queue.h"
+
+// replays every draw in q onto img, in order, using conf->threads workers
+void doodle_render(
+    doodle_image *img, 
+    const doodle_queue *q, 
+    const doodle_config *conf
+);
+
+// memory doodle_render takes on top of img and q, to bin or cull the draws
+// as conf->render asks
+size_t doodle_render_bytes(
+    const doodle_queue *q, 
+    const doodle_config *conf
+);
+
+// Renders q and writes it to out as conf->ft, conf->band_height rows at a
+// time, so only two bands are ever held rather than the whole image. Tiles
+// and culling need the whole image, so bands are always split into plain
+// bands between the workers.
+bool doodle_render_streamed(
+    const doodle_queue *q, 
+    const doodle_config *conf, 
+    FILE *out
+);
+
+// A queue's draws binned into a grid of conf->tile_size tiles over its
+// conf->width x conf->height canvas, once, so any part of the canvas can be
+// rendered from just the draws that reach it.
+typedef struct doodle_scene doodle_scene;
+
+doodle_scene *doodle_scene_new(
+    const doodle_queue *q, 
+    const doodle_config *conf
+);
+void doodle_scene_free(doodle_scene *s);
+
+// width x height pixels of the canvas from (x, y), magnified by scale
+typedef struct {
+    double x, y;
+    uint32_t width, height;
+    double scale;
+} doodle_viewport;
+
+// Renders the viewport into *img, whose memory is reused if it isn't NULL.
+// Pixels beyond the canvas are left as background, and at a scale of 1 from
+// whole pixels the rest match the same part of a whole render. On return
+// *img holds the image memory, NULL or the caller's to free, even when it
+// fails.
+bool doodle_render_viewport(
+    const doodle_scene *s, 
+    const doodle_viewport *v, 
+    doodle_image **img
+);
+
+#endif
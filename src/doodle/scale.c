@@ -0,0 +1,150 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bytes.h"
+#include "scale.h"
+
+// each pixel is the rounded average of the 2x2 block beneath it
+static void halve(
+    uint8_t *dst, 
+    uint32_t width, 
+    uint32_t height, 
+    const uint8_t *src, 
+    uint32_t src_width
+) {
+    size_t src_row = (size_t)src_width * PIXEL_SIZE;
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *top = src + 2 * y * src_row;
+        const uint8_t *bottom = top + src_row;
+        uint8_t *out = dst + (size_t)y * width * PIXEL_SIZE;
+
+        uint32_t x = 0;
+#ifdef __SSE2__
+        // two pixels at a time from four above four, widened to 16 bits so
+        // the sums don't overflow
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i two = _mm_set1_epi16(2);
+        for (; x + 2 <= width; x += 2) {
+            __m128i t = _mm_loadu_si128((const __m128i *)(top + x * 8));
+            __m128i b = _mm_loadu_si128((const __m128i *)(bottom + x * 8));
+            __m128i lo = _mm_add_epi16(
+                _mm_unpacklo_epi8(t, zero), _mm_unpacklo_epi8(b, zero)
+            );
+            __m128i hi = _mm_add_epi16(
+                _mm_unpackhi_epi8(t, zero), _mm_unpackhi_epi8(b, zero)
+            );
+            // each half now holds a pixel's column sums next to its
+            // neighbour's, adding the halves finishes the block
+            lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+            hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+            __m128i sum = _mm_unpacklo_epi64(lo, hi);
+            sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+            _mm_storel_epi64(
+                (__m128i *)(out + x * PIXEL_SIZE), _mm_packus_epi16(sum, sum)
+            );
+        }
+#endif
+        for (; x < width; x++) {
+            const uint8_t *t = top + x * 2 * PIXEL_SIZE;
+            const uint8_t *b = bottom + x * 2 * PIXEL_SIZE;
+            for (int c = 0; c < PIXEL_SIZE; c++) {
+                out[x * PIXEL_SIZE + c] = (
+                    t[c] + t[c + PIXEL_SIZE] + b[c] + b[c + PIXEL_SIZE] + 2
+                ) >> 2;
+            }
+        }
+    }
+}
+
+// How much of source pixel i lies under destination pixel d, where each
+// source pixel is size long and each destination pixel span long.
+static uint64_t overlap(uint64_t i, uint64_t size, uint64_t d, uint64_t span) {
+    uint64_t lo = i * size > d * span ? i * size : d * span;
+    uint64_t hi = (i + 1) * size < (d + 1) * span
+        ? (i + 1) * size
+        : (d + 1) * span;
+    return hi > lo ? hi - lo : 0;
+}
+
+// Measured in 1/width of a source pixel across and 1/height down, each
+// source pixel is width x height and each destination pixel covers
+// src_width x src_height of them. Rows are summed across into sums, weighted
+// by how much of them is covered, and then added up down each column.
+static bool area_average(
+    uint8_t *dst, 
+    uint32_t width, 
+    uint32_t height, 
+    const uint8_t *src, 
+    uint32_t src_width, 
+    uint32_t src_height
+) {
+    uint64_t *sums = malloc((size_t)width * PIXEL_SIZE * sizeof *sums);
+    uint64_t *acc = malloc((size_t)width * PIXEL_SIZE * sizeof *acc);
+    if (sums == NULL || acc == NULL) {
+        free(sums);
+        free(acc);
+        return false;
+    }
+
+    uint64_t total = (uint64_t)src_width * src_height;
+    for (uint32_t y = 0; y < height; y++) {
+        memset(acc, 0, (size_t)width * PIXEL_SIZE * sizeof *acc);
+
+        uint32_t sy0 = (uint64_t)y * src_height / height;
+        uint32_t sy1 = ((uint64_t)(y + 1) * src_height + height - 1) / height;
+        for (uint32_t sy = sy0; sy < sy1; sy++) {
+            uint64_t wy = overlap(sy, height, y, src_height);
+            if (wy == 0) continue;
+
+            const uint8_t *row = src + (size_t)sy * src_width * PIXEL_SIZE;
+            memset(sums, 0, (size_t)width * PIXEL_SIZE * sizeof *sums);
+            for (uint32_t x = 0; x < width; x++) {
+                uint32_t sx0 = (uint64_t)x * src_width / width;
+                uint32_t sx1 = 
+                    ((uint64_t)(x + 1) * src_width + width - 1) / width;
+                for (uint32_t sx = sx0; sx < sx1; sx++) {
+                    uint64_t wx = overlap(sx, width, x, src_width);
+                    for (int c = 0; c < PIXEL_SIZE; c++) {
+                        sums[x * PIXEL_SIZE + c] += 
+                            wx * row[sx * PIXEL_SIZE + c];
+                    }
+                }
+            }
+            for (size_t i = 0; i < (size_t)width * PIXEL_SIZE; i++) {
+                acc[i] += wy * sums[i];
+            }
+        }
+
+        uint8_t *out = dst + (size_t)y * width * PIXEL_SIZE;
+        for (size_t i = 0; i < (size_t)width * PIXEL_SIZE; i++) {
+            out[i] = (acc[i] + total / 2) / total;
+        }
+    }
+
+    free(sums);
+    free(acc);
+    return true;
+}
+
+bool doodle_scale_down(
+    uint8_t *dst, 
+    uint32_t width, 
+    uint32_t height, 
+    const uint8_t *src, 
+    uint32_t src_width, 
+    uint32_t src_height
+) {
+    if ((uint64_t)width * 2 == src_width 
+        && (uint64_t)height * 2 == src_height
+    ) {
+        halve(dst, width, height, src, src_width);
+        return true;
+    }
+    return area_average(dst, width, height, src, src_width, src_height);
+}
@@ -0,0 +1,21 @@
+#ifndef DOODLE_SCALE_H
+#define DOODLE_SCALE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Shrinks src_width x src_height pixels of 4 bytes into dst, each of its
+// pixels the average of the area of src it covers. dst must be no larger
+// either way. Exact halving, the usual step in a mip chain, is a 2x2 box
+// filter and gets a faster path with the same results. False if there
+// wasn't memory to work in.
+bool doodle_scale_down(
+    uint8_t *dst, 
+    uint32_t width, 
+    uint32_t height, 
+    const uint8_t *src, 
+    uint32_t src_width, 
+    uint32_t src_height
+);
+
+#endif
@@ -0,0 +1,54 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "workers.h"
+
+uint32_t doodle_thread_count(const doodle_config *conf) {
+    if (conf->threads != 0) {
+        return conf->threads;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+}
+
+void doodle_run_workers(
+    doodle_worker_fn work, 
+    void *jobs, 
+    size_t job_size, 
+    uint32_t count
+) {
+    char *job = jobs;
+
+    pthread_t *workers = malloc(count * sizeof *workers);
+    bool *started = malloc(count * sizeof *started);
+    if (workers == NULL || started == NULL) {
+        for (uint32_t i = 0; i < count; i++) {
+            work(job + i * job_size);
+        }
+        goto workers_free_exit;
+    }
+
+    for (uint32_t i = 0; i + 1 < count; i++) {
+        started[i] = pthread_create(
+            &workers[i], NULL, work, job + i * job_size
+        ) == 0;
+    }
+    work(job + (count - 1) * job_size);
+
+    for (uint32_t i = 0; i + 1 < count; i++) {
+        if (started[i]) {
+            pthread_join(workers[i], NULL);
+        } else {
+            work(job + i * job_size);
+        }
+    }
+
+workers_free_exit:
+    free(workers);
+    free(started);
+}
@@ -0,0 +1,23 @@
+#ifndef DOODLE_WORKERS_H
+#define DOODLE_WORKERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "doodle.h"
+
+typedef void *(*doodle_worker_fn)(void *);
+
+// the workers conf asks for, one per core if it leaves that open
+uint32_t doodle_thread_count(const doodle_config *conf);
+
+// Runs work over each of the count jobs, the calling thread takes the last 
+// job along with any whose thread couldn't be started.
+void doodle_run_workers(
+    doodle_worker_fn work, 
+    void *jobs, 
+    size_t job_size, 
+    uint32_t count
+);
+
+#endif
@@ -0,0 +1,172 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define BLOCK_SIZE (64 * 1024)
+// size class step, alignment and the room for a block's or large
+// allocation's links ahead of its memory
+#define GRAIN 16
+#define SMALL_MAX 512
+#define CLASSES (SMALL_MAX / GRAIN)
+
+typedef struct {
+    char *prev;
+    char *next;
+} links;
+
+struct arena {
+    char *bump; // unused end of the newest block
+    size_t left;
+    char *blocks;
+    char *large;
+    void *free[CLASSES]; // freed small allocations, linked through themselves
+};
+
+static size_t class_of(size_t size) {
+    return (size - 1) / GRAIN;
+}
+
+static links *links_of(char *header) {
+    return (links *)header;
+}
+
+arena *arena_new(void) {
+    return calloc(1, sizeof(arena));
+}
+
+void arena_free(arena *a) {
+    if (a == NULL) return;
+
+    for (char *b = a->blocks; b != NULL;) {
+        char *next = links_of(b)->next;
+        free(b);
+        b = next;
+    }
+    for (char *l = a->large; l != NULL;) {
+        char *next = links_of(l)->next;
+        free(l);
+        l = next;
+    }
+    free(a);
+}
+
+static void *alloc_small(arena *a, size_t size) {
+    size_t class = class_of(size);
+    void *p = a->free[class];
+    if (p != NULL) {
+        a->free[class] = *(void **)p;
+        return p;
+    }
+
+    size_t rounded = (class + 1) * GRAIN;
+    if (a->left < rounded) {
+        char *b = malloc(BLOCK_SIZE);
+        if (b == NULL) {
+            return NULL;
+        }
+        links_of(b)->next = a->blocks;
+        a->blocks = b;
+        a->bump = b + GRAIN;
+        a->left = BLOCK_SIZE - GRAIN;
+    }
+
+    p = a->bump;
+    a->bump += rounded;
+    a->left -= rounded;
+    return p;
+}
+
+static void link_large(arena *a, char *l) {
+    links_of(l)->prev = NULL;
+    links_of(l)->next = a->large;
+    if (a->large != NULL) {
+        links_of(a->large)->prev = l;
+    }
+    a->large = l;
+}
+
+static void unlink_large(arena *a, char *l) {
+    links *ls = links_of(l);
+    if (ls->prev != NULL) {
+        links_of(ls->prev)->next = ls->next;
+    } else {
+        a->large = ls->next;
+    }
+    if (ls->next != NULL) {
+        links_of(ls->next)->prev = ls->prev;
+    }
+}
+
+static void *alloc(arena *a, size_t size) {
+    if (size <= SMALL_MAX) {
+        return alloc_small(a, size);
+    }
+
+    if (size > SIZE_MAX - GRAIN) {
+        return NULL;
+    }
+    char *l = malloc(GRAIN + size);
+    if (l == NULL) {
+        return NULL;
+    }
+    link_large(a, l);
+    return l + GRAIN;
+}
+
+static void release(arena *a, void *ptr, size_t size) {
+    if (size <= SMALL_MAX) {
+        size_t class = class_of(size);
+        *(void **)ptr = a->free[class];
+        a->free[class] = ptr;
+        return;
+    }
+
+    char *l = (char *)ptr - GRAIN;
+    unlink_large(a, l);
+    free(l);
+}
+
+void *arena_realloc(arena *a, void *ptr, size_t osize, size_t nsize) {
+    if (nsize == 0) {
+        if (ptr != NULL) {
+            release(a, ptr, osize);
+        }
+        return NULL;
+    }
+    if (ptr == NULL) {
+        return alloc(a, nsize);
+    }
+
+    if (osize <= SMALL_MAX && nsize <= SMALL_MAX
+        && class_of(osize) == class_of(nsize)
+    ) {
+        return ptr;
+    }
+
+    if (osize > SMALL_MAX && nsize > SMALL_MAX) {
+        if (nsize > SIZE_MAX - GRAIN) {
+            return NULL;
+        }
+        char *l = (char *)ptr - GRAIN;
+        unlink_large(a, l);
+        char *grown = realloc(l, GRAIN + nsize);
+        if (grown == NULL) {
+            link_large(a, l);
+            return nsize < osize ? ptr : NULL;
+        }
+        link_large(a, grown);
+        return grown + GRAIN;
+    }
+
+    void *p = alloc(a, nsize);
+    if (p == NULL) {
+        // lua counts on shrinking never failing, the old memory does just as
+        // well and is reclaimed with the arena if it came from malloc
+        return nsize < osize ? ptr : NULL;
+    }
+    memcpy(p, ptr, osize < nsize ? osize : nsize);
+    release(a, ptr, osize);
+    return p;
+}
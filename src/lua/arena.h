@@ -0,0 +1,18 @@
+#ifndef DOODLE_ARENA_H
+#define DOODLE_ARENA_H
+
+#include <stddef.h>
+
+// Memory for one lua state. Small allocations are carved out of large blocks
+// and recycled through free lists by size class, large ones come from malloc.
+// Everything is released together by arena_free.
+typedef struct arena arena;
+
+arena *arena_new(void);
+void arena_free(arena *a);
+
+// lua_Alloc's realloc, taking ptr's size as osize. Returns NULL on failure or
+// when nsize is 0.
+void *arena_realloc(arena *a, void *ptr, size_t osize, size_t nsize);
+
+#endif
@@ -0,0 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "lua.h"
+#include "doodle/doodle.h"
+
+static bool read_u32(FILE *in, uint32_t *n) {
+    uint8_t b[4];
+    if (fread(b, 1, sizeof b, in) != sizeof b) {
+        return false;
+    }
+    *n = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 
+        | (uint32_t)b[2] << 8 | b[3];
+    return true;
+}
+
+static bool read_u8(FILE *in, uint8_t *n) {
+    return fread(n, 1, 1, in) == 1;
+}
+
+static bool read_u64(FILE *in, uint64_t *n) {
+    uint32_t high, low;
+    if (!read_u32(in, &high) || !read_u32(in, &low)) {
+        return false;
+    }
+    *n = (uint64_t)high << 32 | low;
+    return true;
+}
+
+static bool write_u32(FILE *out, uint32_t n) {
+    uint8_t b[4] = { n >> 24, n >> 16, n >> 8, n };
+    return fwrite(b, 1, sizeof b, out) == sizeof b;
+}
+
+// grows buf to hold size bytes and a terminating zero, then reads them
+static bool read_field(FILE *in, char **buf, size_t *cap, uint32_t size) {
+    if ((size_t)size + 1 > *cap) {
+        char *grown = realloc(*buf, (size_t)size + 1);
+        if (grown == NULL) {
+            fputs("failed to allocate job buffer\n", stderr);
+            return false;
+        }
+        *buf = grown;
+        *cap = (size_t)size + 1;
+    }
+    if (fread(*buf, 1, size, in) != size) {
+        fputs("truncated job\n", stderr);
+        return false;
+    }
+    (*buf)[size] = '\0';
+    return true;
+}
+
+static bool respond(FILE *out, uint32_t status, const void *data, size_t size) {
+    return size <= UINT32_MAX
+        && write_u32(out, status)
+        && write_u32(out, size)
+        && fwrite(data, 1, size, out) == size
+        && fflush(out) == 0;
+}
+
+static bool respond_error(
+    FILE *out, 
+    doodle_lua_error_type et, 
+    const char *msg
+) {
+    return respond(out, et + 1, msg, strlen(msg));
+}
+
+// encodes img to memory and sends it
+static bool respond_image(FILE *out, doodle_image *img, doodle_config *conf) {
+    char *data = NULL;
+    size_t size = 0;
+
+    FILE *mem = open_memstream(&data, &size);
+    if (mem == NULL) {
+        return respond_error(out, DOODLE_LERR_IMG_N_FAIL, "encoding failed");
+    }
+    bool encoded = doodle_export(img, conf, mem);
+    encoded = fclose(mem) == 0 && encoded;
+
+    bool sent = encoded
+        ? respond(out, 0, data, size)
+        : respond_error(out, DOODLE_LERR_IMG_N_FAIL, "encoding failed");
+    free(data);
+    return sent;
+}
+
+// Encodes img straight into a new file at path, usually on a tmpfs like
+// /dev/shm, and sends its size as a 64 bit number. Nothing already at path,
+// a symlink least of all, is written through. The file is left read only,
+// it's not changed after this.
+static bool respond_file(
+    FILE *out, 
+    doodle_image *img, 
+    doodle_config *conf, 
+    const char *path
+) {
+    int fd = open(
+        path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
+    );
+    FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (f == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        return respond_error(
+            out, DOODLE_LERR_IMG_N_FAIL, "failed to open output"
+        );
+    }
+
+    // the raw exporter may write around stdio, so the size is taken from the
+    // file rather than the stream's position
+    struct stat st;
+    bool encoded = doodle_export(img, conf, f)
+        && fflush(f) == 0
+        && fstat(fileno(f), &st) == 0
+        && fchmod(fileno(f), S_IRUSR | S_IRGRP | S_IROTH) == 0;
+    encoded = fclose(f) == 0 && encoded;
+    if (!encoded) {
+        unlink(path);
+        return respond_error(out, DOODLE_LERR_IMG_N_FAIL, "encoding failed");
+    }
+
+    uint64_t size = st.st_size;
+    uint8_t b[8] = {
+        size >> 56, size >> 48, size >> 40, size >> 32, 
+        size >> 24, size >> 16, size >> 8, size,
+    };
+    return respond(out, 0, b, sizeof b);
+}
+
+int run_daemon(
+    FILE *in, 
+    FILE *out, 
+    script_cache *cache, 
+    const doodle_config *defaults
+) {
+    int status = EXIT_FAILURE;
+
+    char *script = NULL;
+    size_t script_cap = 0;
+    char *path = NULL;
+    size_t path_cap = 0;
+    doodle_image *img = NULL;
+
+    // the state for the next job, set up while waiting for it
+    doodle_lua_state *next = doodle_lua_prepare(defaults->ffi);
+
+    uint64_t memory_limit;
+    while (read_u64(in, &memory_limit)) {
+        uint32_t time_limit, path_size, size;
+        uint8_t png_profile, ft;
+        if (!read_u32(in, &time_limit) || !read_u8(in, &png_profile)
+            || !read_u8(in, &ft) || !read_u32(in, &path_size)
+            || !read_u32(in, &size)
+        ) {
+            fputs("truncated job\n", stderr);
+            goto daemon_exit;
+        }
+
+        if (!read_field(in, &path, &path_cap, path_size)
+            || !read_field(in, &script, &script_cap, size)
+        ) {
+            goto daemon_exit;
+        }
+
+        doodle_lua_state *s = next != NULL
+            ? next
+            : doodle_lua_prepare(defaults->ffi);
+        next = NULL;
+
+        bool sent;
+        if (s == NULL) {
+            sent = respond_error(
+                out, DOODLE_LERR_INIT_FAIL, "lua setup failed"
+            );
+        } else {
+            // the image memory is kept for the next job, so a run of same
+            // sized renders doesn't allocate a framebuffer each time
+            doodle_config conf = *defaults;
+            if (memory_limit > 0) {
+                conf.memory_limit = memory_limit < SIZE_MAX 
+                    ? memory_limit 
+                    : SIZE_MAX;
+            }
+            if (time_limit > 0) {
+                conf.time_limit = time_limit;
+            }
+            if (png_profile <= DOODLE_PNG_SMALLEST) {
+                conf.png_profile = png_profile;
+            }
+            if (ft <= DOODLE_FT_QOI) {
+                conf.ft = ft;
+            }
+            doodle_lua_error *err =
+                doodle_lua_run_buffer(s, script, size, cache, &img, &conf);
+            if (err != NULL) {
+                sent = respond_error(out, err->et, err->msg);
+                free(err);
+            } else if (path_size > 0) {
+                sent = respond_file(out, img, &conf, path);
+            } else {
+                sent = respond_image(out, img, &conf);
+            }
+        }
+        if (!sent) {
+            fputs("failed to write response\n", stderr);
+            goto daemon_exit;
+        }
+
+        next = doodle_lua_prepare(defaults->ffi);
+    }
+
+    if (feof(in)) {
+        status = EXIT_SUCCESS;
+    }
+
+daemon_exit:
+    doodle_lua_discard(next);
+    free(img);
+    free(script);
+    free(path);
+
+    return status;
+}
@@ -0,0 +1,26 @@
+#ifndef DOODLE_DAEMON_H
+#define DOODLE_DAEMON_H
+
+#include <stdio.h>
+
+#include "script_cache.h"
+#include "doodle/doodle.h"
+
+// Serves render jobs until in is closed, returning an exit status. A job is
+// its memory limit in bytes, its time limit in milliseconds, a byte each for
+// its doodle_png_profile and doodle_file_type, the lengths of its output path
+// and script and then the path and script themselves. The script is loaded
+// through cache unless it's NULL. Limits of 0 and unknown profiles or file
+// types fall back to those in defaults. The response is a status, 0 or a
+// doodle_lua_error_type + 1, followed by the length prefixed image or error
+// message. Given a path the image is written to a file there instead, and
+// the response holds its 64 bit size. Numbers are big endian and 32 bit,
+// other than the memory limit and file size.
+int run_daemon(
+    FILE *in, 
+    FILE *out, 
+    script_cache *cache, 
+    const doodle_config *defaults
+);
+
+#endif
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <luajit-2.1/lua.h>
 #include <luajit-2.1/lauxlib.h>
 #include <luajit-2.1/lualib.h>
@@ -7,74 +9,53 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "lua.h"
+#include "arena.h"
 #include "lua_helpers.h"
 #include "lua_point.h"
 #include "lua_color.h"
+#include "lua_ffi.h"
+#include "lua_script.h"
 #include "doodle/doodle.h"
+#include "doodle/queue.h"
+#include "doodle/render.h"
 
 #define READER_BUF_SIZE 2048
-
-typedef enum {
-    RECTANGLE_DRAW,
-    CIRCLE_DRAW,
-    LINE_DRAW,
-} draw_type;
-
-typedef struct {
-    doodle_point origin;
-    uint32_t width;
-    uint32_t height;
-    doodle_color color;
-} rect_draw;
-
-typedef struct {
-    doodle_point origin;
-    uint32_t radius;
-    doodle_color color;
-} circ_draw;
-
-typedef struct {
-    doodle_point p1;
-    doodle_point p2;
-    double thickness;
-    doodle_color color;
-} line_draw;
-
-typedef struct draw {
-    draw_type type;
-    struct draw *next;
-    union {
-        rect_draw rect;
-        circ_draw circle;
-        line_draw line;
-    } params;
-} draw;
-
-typedef struct {
-    draw *root;
-    draw *tail;
-} draw_queue;
+#define CHUNK_NAME "doodle script"
+// instructions between checks of the time limit
+#define HOOK_INTERVAL 10000
+// a render's state is thrown away soon after it's made, so by default the
+// collector waits for the heap to grow fourfold, unless that might run into
+// a memory limit first
+#define GC_PAUSE 400
 
 typedef struct {
     FILE *in;
     char buf[READER_BUF_SIZE];
 } file_read_data;
 
-static void env_draw_queue_push(lua_State *L, draw *d) {
-    lua_getfield(L, LUA_ENVIRONINDEX, "draw_queue");
-    draw_queue *queue = lua_touserdata(L, -1);
+static doodle_script *env_script(lua_State *L) {
+    lua_getfield(L, LUA_ENVIRONINDEX, "script");
+    doodle_script *s = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return s;
+}
 
-    if (queue->root == NULL) {
-        queue->root = d;
-        queue->tail = d;
-    } else {
-        queue->tail->next = d;
-        queue->tail = d;
+static void script_draw(lua_State *L, doodle_script *s, const doodle_draw *d) {
+    if (!script_push(s, d)) {
+        luaL_error(
+            L, "failed to queue draw: %s", 
+            s->over_limit ? "over the memory limit" : "out of memory"
+        );
     }
 }
 
+static void env_script_draw(lua_State *L, const doodle_draw *d) {
+    script_draw(L, env_script(L), d);
+}
+
 static doodle_lua_error *new_error(doodle_lua_error_type et, const char *msg) {
     doodle_lua_error *err = malloc(strlen(msg) + 1 + sizeof *err);
     err->et = et;
@@ -82,6 +63,19 @@ static doodle_lua_error *new_error(doodle_lua_error_type et, const char *msg) {
     return err;
 }
 
+static doodle_lua_error *limit_error(doodle_lua_error_type et) {
+    switch (et) {
+    case DOODLE_LERR_MEMORY_LIMIT:
+        return new_error(et, "script went over the memory limit");
+    case DOODLE_LERR_TIME_LIMIT:
+        return new_error(et, "script went over the time limit");
+    case DOODLE_LERR_DRAW_LIMIT:
+        return new_error(et, "queued draws went over the memory limit");
+    default:
+        return new_error(et, "image is over the memory limit");
+    }
+}
+
 static const char *read_file(lua_State *L, void *data, size_t *size) {
     file_read_data *f = data;
     if (feof(f->in) || ferror(f->in)) {
@@ -99,6 +93,34 @@ static const char *read_file(lua_State *L, void *data, size_t *size) {
     return f->buf;
 }
 
+// reads all of in, the caller frees the result
+static char *read_all(FILE *in, size_t *size) {
+    size_t cap = 4096;
+    char *data = malloc(cap);
+    *size = 0;
+
+    while (data != NULL) {
+        *size += fread(data + *size, 1, cap - *size, in);
+        if (*size < cap) {
+            break;
+        }
+
+        cap *= 2;
+        char *grown = realloc(data, cap);
+        if (grown == NULL) {
+            free(data);
+            return NULL;
+        }
+        data = grown;
+    }
+
+    if (data != NULL && ferror(in)) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
 static doodle_lua_error *get_global_u32(
     lua_State *L, 
     const char *key, 
@@ -190,14 +212,16 @@ static int draw_rect(lua_State *L) {
         }
     }
 
-    draw *d = malloc(sizeof *d);
-    d->type = RECTANGLE_DRAW;
-    d->next = NULL;
-    d->params.rect.origin = *origin;
-    d->params.rect.width = width;
-    d->params.rect.height = height;
-    d->params.rect.color = *color;
-    env_draw_queue_push(L, d);
+    doodle_draw d = {
+        .type = DOODLE_DRAW_RECT,
+        .params.rect = {
+            .origin = *origin,
+            .width = width,
+            .height = height,
+            .color = *color,
+        },
+    };
+    env_script_draw(L, &d);
 
     return 0;
 }
@@ -231,13 +255,15 @@ static int draw_circle(lua_State *L) {
         }
     }
 
-    draw *d = malloc(sizeof *d);
-    d->type = CIRCLE_DRAW;
-    d->next = NULL;
-    d->params.circle.origin = *origin;
-    d->params.circle.radius = radius;
-    d->params.circle.color = *color;
-    env_draw_queue_push(L, d);
+    doodle_draw d = {
+        .type = DOODLE_DRAW_CIRCLE,
+        .params.circle = {
+            .origin = *origin,
+            .radius = radius,
+            .color = *color,
+        },
+    };
+    env_script_draw(L, &d);
 
     return 0;
 }
@@ -274,14 +300,245 @@ static int draw_line(lua_State *L) {
         }
     }
 
-    draw *d = malloc(sizeof *d);
-    d->type = LINE_DRAW;
-    d->next = NULL;
-    d->params.line.p1 = *p1;
-    d->params.line.p2 = *p2;
-    d->params.line.thickness = thickness;
-    d->params.line.color = *color;
-    env_draw_queue_push(L, d);
+    doodle_draw d = {
+        .type = DOODLE_DRAW_LINE,
+        .params.line = {
+            .p1 = *p1,
+            .p2 = *p2,
+            .thickness = thickness,
+            .color = *color,
+        },
+    };
+    env_script_draw(L, &d);
+
+    return 0;
+}
+
+// A field of a bulk draw, either an array under the plural key holding a 
+// value per draw, or a single value under the singular key shared by all.
+typedef struct {
+    const char *key;
+    int array; // stack index of the array, 0 when shared
+    double shared;
+} number_field;
+
+typedef struct {
+    const char *key;
+    int array;
+    doodle_color shared;
+} color_field;
+
+static const char *BULK_LENGTH = "%s error: %s has %d values, expected %d";
+static const char *BULK_TYPE = "%s error: %s[%d] must be a %s";
+
+// number of draws in a bulk draw, the length of the array under key
+static size_t bulk_count(lua_State *L, const char *fn, const char *key) {
+    lua_getfield(L, 1, key);
+    if (!lua_istable(L, -1)) {
+        lua_pushfstring(L, NOT_PROVIDED, fn, key);
+        lua_error(L);
+    }
+    size_t count = lua_objlen(L, -1);
+    lua_pop(L, 1);
+    return count;
+}
+
+// leaves the array under key on the stack, returning its index, or returns 0
+static int get_bulk_array(
+    lua_State *L, 
+    const char *fn, 
+    const char *key, 
+    size_t count
+) {
+    lua_getfield(L, 1, key);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    if (lua_objlen(L, -1) != count) {
+        luaL_error(L, BULK_LENGTH, fn, key, (int)lua_objlen(L, -1), (int)count);
+    }
+    return lua_gettop(L);
+}
+
+// shared may be NULL when every draw needs its own value
+static void get_number_field(
+    lua_State *L, 
+    const char *fn, 
+    const char *key, 
+    const char *shared, 
+    size_t count, 
+    number_field *f
+) {
+    f->key = key;
+    f->array = get_bulk_array(L, fn, key, count);
+    if (f->array == 0 
+        && (shared == NULL || !getf_number(L, shared, &f->shared))
+    ) {
+        lua_pushfstring(L, NOT_PROVIDED, fn, key);
+        lua_error(L);
+    }
+}
+
+static void get_color_field(
+    lua_State *L, 
+    const char *fn, 
+    const char *key, 
+    const char *shared, 
+    size_t count, 
+    color_field *f
+) {
+    doodle_color *color;
+
+    f->key = key;
+    f->array = get_bulk_array(L, fn, key, count);
+    if (f->array == 0) {
+        if (!getf_userdata(L, shared, "doodle.color", (void**)&color)) {
+            lua_pushfstring(L, NOT_PROVIDED, fn, key);
+            lua_error(L);
+        }
+        f->shared = *color;
+    }
+}
+
+static double number_at(
+    lua_State *L, 
+    const char *fn, 
+    const number_field *f, 
+    size_t i
+) {
+    if (f->array == 0) {
+        return f->shared;
+    }
+
+    lua_rawgeti(L, f->array, i + 1);
+    if (!lua_isnumber(L, -1)) {
+        luaL_error(L, BULK_TYPE, fn, f->key, (int)i + 1, "number");
+    }
+    double n = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return n;
+}
+
+static doodle_color color_at(
+    lua_State *L, 
+    const char *fn, 
+    const color_field *f, 
+    size_t i
+) {
+    if (f->array == 0) {
+        return f->shared;
+    }
+
+    lua_rawgeti(L, f->array, i + 1);
+    if (!lua_isuserdata(L, -1) || !has_metatable(L, "doodle.color")) {
+        luaL_error(L, BULK_TYPE, fn, f->key, (int)i + 1, "doodle.color");
+    }
+    doodle_color c = *(doodle_color*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return c;
+}
+
+static int draw_rects(lua_State *L) {
+    static const char *fn = "rectangles";
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    number_field xs, ys, widths, heights;
+    color_field colors;
+
+    size_t count = bulk_count(L, fn, "xs");
+    get_number_field(L, fn, "xs", NULL, count, &xs);
+    get_number_field(L, fn, "ys", NULL, count, &ys);
+    get_number_field(L, fn, "widths", "width", count, &widths);
+    get_number_field(L, fn, "heights", "height", count, &heights);
+    get_color_field(L, fn, "colors", "color", count, &colors);
+
+    doodle_script *s = env_script(L);
+    for (size_t i = 0; i < count; i++) {
+        doodle_draw d = {
+            .type = DOODLE_DRAW_RECT,
+            .params.rect = {
+                .origin = {
+                    .x = number_at(L, fn, &xs, i), 
+                    .y = number_at(L, fn, &ys, i),
+                },
+                .width = number_at(L, fn, &widths, i),
+                .height = number_at(L, fn, &heights, i),
+                .color = color_at(L, fn, &colors, i),
+            },
+        };
+        script_draw(L, s, &d);
+    }
+
+    return 0;
+}
+
+static int draw_circles(lua_State *L) {
+    static const char *fn = "circles";
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    number_field xs, ys, radii;
+    color_field colors;
+
+    size_t count = bulk_count(L, fn, "xs");
+    get_number_field(L, fn, "xs", NULL, count, &xs);
+    get_number_field(L, fn, "ys", NULL, count, &ys);
+    get_number_field(L, fn, "radii", "radius", count, &radii);
+    get_color_field(L, fn, "colors", "color", count, &colors);
+
+    doodle_script *s = env_script(L);
+    for (size_t i = 0; i < count; i++) {
+        doodle_draw d = {
+            .type = DOODLE_DRAW_CIRCLE,
+            .params.circle = {
+                .origin = {
+                    .x = number_at(L, fn, &xs, i), 
+                    .y = number_at(L, fn, &ys, i),
+                },
+                .radius = number_at(L, fn, &radii, i),
+                .color = color_at(L, fn, &colors, i),
+            },
+        };
+        script_draw(L, s, &d);
+    }
+
+    return 0;
+}
+
+static int draw_lines(lua_State *L) {
+    static const char *fn = "lines";
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    number_field x1s, y1s, x2s, y2s, thicknesses;
+    color_field colors;
+
+    size_t count = bulk_count(L, fn, "x1s");
+    get_number_field(L, fn, "x1s", NULL, count, &x1s);
+    get_number_field(L, fn, "y1s", NULL, count, &y1s);
+    get_number_field(L, fn, "x2s", NULL, count, &x2s);
+    get_number_field(L, fn, "y2s", NULL, count, &y2s);
+    get_number_field(L, fn, "thicknesses", "thickness", count, &thicknesses);
+    get_color_field(L, fn, "colors", "color", count, &colors);
+
+    doodle_script *s = env_script(L);
+    for (size_t i = 0; i < count; i++) {
+        doodle_draw d = {
+            .type = DOODLE_DRAW_LINE,
+            .params.line = {
+                .p1 = {
+                    .x = number_at(L, fn, &x1s, i), 
+                    .y = number_at(L, fn, &y1s, i),
+                },
+                .p2 = {
+                    .x = number_at(L, fn, &x2s, i), 
+                    .y = number_at(L, fn, &y2s, i),
+                },
+                .thickness = number_at(L, fn, &thicknesses, i),
+                .color = color_at(L, fn, &colors, i),
+            },
+        };
+        script_draw(L, s, &d);
+    }
 
     return 0;
 }
@@ -290,17 +547,19 @@ static int set_global_functions(lua_State *L) {
     luaL_Reg global_functions[] = {
         {"point", create_point},
         {"color", create_color},
+        {"canvas", set_canvas},
         {"rectangle", draw_rect},
         {"circle", draw_circle},
         {"line", draw_line},
+        {"rectangles", draw_rects},
+        {"circles", draw_circles},
+        {"lines", draw_lines},
         {NULL, NULL}
     };
 
     lua_newtable(L);
-    draw_queue *queue = lua_newuserdata(L, sizeof *queue);
-    queue->root = NULL;
-    queue->tail = NULL;
-    lua_setfield(L, -2, "draw_queue");
+    lua_pushvalue(L, 1);
+    lua_setfield(L, -2, "script");
     lua_replace(L, LUA_ENVIRONINDEX);
 
     for (size_t i = 0; global_functions[i].name != NULL; i++) {
@@ -308,16 +567,125 @@ static int set_global_functions(lua_State *L) {
         lua_setglobal(L, global_functions[i].name);
     }
 
-    lua_pushlightuserdata(L, queue);
+    return 0;
+}
 
-    return 1;
+struct doodle_lua_state {
+    lua_State *L;
+    doodle_script script;
+    arena *arena; // NULL when lua uses its own allocator
+    bool closing; // frees can be left to arena_free
+};
+
+// Counts the state's memory, refusing to go over the script's limit, and
+// takes it from the state's arena.
+static void *limited_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    doodle_lua_state *s = ud;
+
+    if (nsize == 0) {
+        if (!s->closing) {
+            arena_realloc(s->arena, ptr, osize, 0);
+            s->script.lua_memory -= osize;
+        }
+        return NULL;
+    }
+
+    if (nsize > osize 
+        && !script_fits(&s->script, nsize - osize, DOODLE_LERR_MEMORY_LIMIT)
+    ) {
+        return NULL;
+    }
+
+    void *p = arena_realloc(s->arena, ptr, osize, nsize);
+    if (p != NULL) {
+        s->script.lua_memory = s->script.lua_memory - osize + nsize;
+    }
+    return p;
+}
+
+static int panic(lua_State *L) {
+    fprintf(
+        stderr, "PANIC: unprotected error in call to Lua API (%s)\n", 
+        lua_tostring(L, -1)
+    );
+    return 0;
+}
+
+// only the script's own thread, render workers and the immediate mode
+// renderer don't count against its time
+static uint64_t cpu_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static lua_State *setup_state(draw_queue **queue) {
-    lua_State *L = luaL_newstate();
+static void limit_hook(lua_State *L, lua_Debug *ar) {
+    lua_getfield(L, LUA_REGISTRYINDEX, "doodle.script");
+    doodle_lua_state *s = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    doodle_script *script = &s->script;
+    if (s->arena == NULL) {
+        script->lua_memory = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 
+            + lua_gc(L, LUA_GCCOUNTB, 0);
+        script_fits(script, 0, DOODLE_LERR_MEMORY_LIMIT);
+    }
+    if (script->conf->time_limit > 0 && cpu_time() > script->deadline 
+        && !script->over_limit
+    ) {
+        script->over_limit = true;
+        script->limit = DOODLE_LERR_TIME_LIMIT;
+    }
+
+    if (script->over_limit) {
+        // from now on every instruction fails, so a script can't keep going
+        // by catching the error
+        lua_sethook(L, limit_hook, LUA_MASKCOUNT, 1);
+        luaL_error(L, "script is over its %s limit", 
+            script->limit == DOODLE_LERR_TIME_LIMIT ? "time" : "memory"
+        );
+    }
+}
+
+// LuaJIT's 64 bit builds without GC64 only run on their own allocator, and 
+// say so on stderr the first time, so after that it isn't asked again.
+static bool custom_alloc_unsupported = false;
+
+doodle_lua_state *doodle_lua_prepare(bool ffi) {
+    doodle_lua_state *s = malloc(sizeof *s);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->script = (doodle_script) { .queue = doodle_queue_new() };
+    if (s->script.queue == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->closing = false;
+
+    lua_State *L = NULL;
+    s->arena = custom_alloc_unsupported ? NULL : arena_new();
+    if (s->arena != NULL) {
+        L = lua_newstate(limited_alloc, s);
+        custom_alloc_unsupported = L == NULL;
+    }
+    if (L != NULL) {
+        lua_atpanic(L, panic);
+    } else {
+        arena_free(s->arena);
+        s->arena = NULL;
+        L = luaL_newstate();
+    }
     if (L == NULL) {
+        doodle_queue_free(s->script.queue);
+        free(s);
         return NULL;
     }
+    s->L = L;
+
+    lua_pushlightuserdata(L, s);
+    lua_setfield(L, LUA_REGISTRYINDEX, "doodle.script");
 
     luaopen_math(L);
     luaopen_base(L);
@@ -328,31 +696,71 @@ static lua_State *setup_state(draw_queue **queue) {
     lua_setglobal(L, "background");
 
     lua_pushcfunction(L, set_global_functions);
-    lua_call(L, 0, 1);
+    lua_pushlightuserdata(L, &s->script);
+    lua_call(L, 1, 0);
+
+    if (ffi) {
+        lua_pushcfunction(L, set_ffi_module);
+        lua_pushlightuserdata(L, &s->script);
+        if (lua_pcall(L, 1, 0, 0) != 0) {
+            doodle_lua_discard(s);
+            return NULL;
+        }
+    }
 
-    *queue = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    return s;
+}
 
-    return L;
+void doodle_lua_discard(doodle_lua_state *s) {
+    if (s == NULL) return;
+
+    // lua_close still visits every object, but with an arena their memory
+    // is handed back all at once afterwards
+    s->closing = s->arena != NULL;
+    lua_close(s->L);
+    arena_free(s->arena);
+    script_wait(&s->script);
+    doodle_queue_free(s->script.queue);
+    doodle_queue_free(s->script.rendering);
+    free(s);
 }
 
-doodle_lua_error *doodle_lua_run_file(
-    FILE *in, 
+// runs the script loaded onto s's stack, or reports the error loading it,
+// with out set the image is also written there, in bands if conf asks for it,
+// and with queue set the script's draws are handed over there unrendered
+static doodle_lua_error *run(
+    doodle_lua_state *s, 
+    int load_status, 
     doodle_image **img, 
-    doodle_config *conf
+    doodle_queue **queue, 
+    doodle_config *conf, 
+    FILE *out
 ) {
-    file_read_data f = { .in = in };
-
-    draw_queue *queue;
+    lua_State *L = s->L;
+    doodle_script *script = &s->script;
+    script->conf = conf;
+    script->img = *img;
 
     doodle_lua_error *err = NULL;
 
-    lua_State *L = setup_state(&queue);
-    if (L == NULL) {
-        return new_error(DOODLE_LERR_INIT_FAIL, "lua setup failed");
+    if (conf->time_limit > 0 
+        || (conf->memory_limit > 0 && s->arena == NULL)
+    ) {
+        script->deadline = cpu_time() + (uint64_t)conf->time_limit * 1000000;
+        lua_sethook(L, limit_hook, LUA_MASKCOUNT, HOOK_INTERVAL);
     }
 
-    if (lua_load(L, read_file, &f, "doodle script") != 0) {
+    int pause = conf->gc_pause > 0 ? (int)conf->gc_pause
+        : conf->memory_limit > 0 ? 0 
+        : GC_PAUSE;
+    if (pause > 0) {
+        lua_gc(L, LUA_GCSETPAUSE, pause);
+    }
+    if (conf->gc_stepmul > 0) {
+        lua_gc(L, LUA_GCSETSTEPMUL, conf->gc_stepmul);
+    }
+
+    if (load_status != 0) {
         err = new_error( DOODLE_LERR_LOAD_FAIL, lua_tostring(L, -1));
         goto run_lua_close_exit;
     }
@@ -361,6 +769,25 @@ doodle_lua_error *doodle_lua_run_file(
         err = new_error( DOODLE_LERR_RUN_FAIL, lua_tostring(L, -1));
         goto run_lua_close_exit;
     }
+    if (script->over_limit) {
+        err = limit_error(script->limit);
+        goto run_lua_close_exit;
+    }
+
+    // in immediate mode only the last batch is left to draw, the rest is
+    // already on the canvas rather than in the queue
+    if (script->canvas && queue != NULL) {
+        err = new_error(DOODLE_LERR_IMG_N_FAIL, "canvas can't be recorded");
+        goto run_lua_close_exit;
+    }
+    if (script->canvas) {
+        if (!script_flush(script)) {
+            err = limit_error(script->limit);
+        } else if (out != NULL && !doodle_export(script->img, conf, out)) {
+            err = new_error(DOODLE_LERR_IMG_N_FAIL, "image export failed");
+        }
+        goto run_lua_close_exit;
+    }
 
     doodle_color *background;
     err = get_global_userdata(L, "background", "doodle.color", (void**)&background);
@@ -374,54 +801,158 @@ doodle_lua_error *doodle_lua_run_file(
 
     conf->background = *background;
 
-    *img = doodle_new(conf);
-    if (*img == NULL) {
-        lua_close(L);
-        return new_error(
-            DOODLE_LERR_IMG_N_FAIL,
-            "image creation failed"
+    // an optimizer that runs out of memory leaves the queue as it was
+    if (conf->optimize) {
+        if (!script_fits(
+                script, doodle_queue_optimize_bytes(script->queue), 
+                DOODLE_LERR_MEMORY_LIMIT
+            )
+        ) {
+            err = limit_error(script->limit);
+            goto run_lua_close_exit;
+        }
+        doodle_queue_optimize(
+            script->queue, conf->width, conf->height, &conf->stats
         );
     }
 
-    for (draw *d = queue->root; d != NULL;) {
-        switch (d->type) {
-        case RECTANGLE_DRAW:
-            doodle_draw_rect(
-                *img, 
-                d->params.rect.origin, 
-                d->params.rect.width,
-                d->params.rect.height,
-                d->params.rect.color
-            );
-            break;
-        case CIRCLE_DRAW:
-            doodle_draw_circle(
-                *img,
-                d->params.circle.origin,
-                d->params.circle.radius,
-                d->params.circle.color
-            );
-            break;
-        case LINE_DRAW:
-            doodle_draw_line(
-                *img,
-                d->params.line.p1,
-                d->params.line.p2,
-                d->params.line.thickness,
-                d->params.line.color
-            );
-            break;
+    if (queue != NULL) {
+        *queue = script->queue;
+        script->queue = NULL;
+        goto run_lua_close_exit;
+    }
+
+    if (out != NULL && conf->band_height > 0) {
+        size_t bands = doodle_band_size(conf, conf->band_height);
+        if (!script_fits(
+                script, bands < SIZE_MAX / 2 ? 2 * bands : SIZE_MAX, 
+                DOODLE_LERR_PIXEL_LIMIT
+            )
+        ) {
+            err = limit_error(script->limit);
+        } else if (!doodle_render_streamed(script->queue, conf, out)) {
+            err = new_error(DOODLE_LERR_IMG_N_FAIL, "image export failed");
         }
-        draw *tmp = d;
-        d = d->next;
-        free(tmp);
+        goto run_lua_close_exit;
+    }
+
+    // binning or culling the queue needs memory alongside the image
+    size_t image_bytes = doodle_size(conf);
+    if (!script_fits(script, image_bytes, DOODLE_LERR_PIXEL_LIMIT)
+        || !script_fits(
+            script, image_bytes + doodle_render_bytes(script->queue, conf), 
+            DOODLE_LERR_MEMORY_LIMIT
+        )
+    ) {
+        err = limit_error(script->limit);
+        goto run_lua_close_exit;
+    }
+
+    doodle_image *renewed = doodle_renew(script->img, conf);
+    if (renewed == NULL) {
+        err = new_error(DOODLE_LERR_IMG_N_FAIL, "image creation failed");
+        goto run_lua_close_exit;
+    }
+    script->img = renewed;
+
+    doodle_render(script->img, script->queue, conf);
+    if (out != NULL && !doodle_export(script->img, conf, out)) {
+        err = new_error(DOODLE_LERR_IMG_N_FAIL, "image export failed");
     }
-    queue->root = NULL;
-    queue->tail = NULL;
 
 run_lua_close_exit:
-    lua_close(L);
+    // a batch still being drawn when the script failed is done with the image
+    script_wait(script);
+
+    // errors from a broken limit surface as whatever failed because of it
+    if (err != NULL && script->over_limit && err->et != script->limit) {
+        free(err);
+        err = limit_error(script->limit);
+    }
+
+    *img = script->img;
+    doodle_lua_discard(s);
+
+    return err;
+}
+
+doodle_lua_error *doodle_lua_run_buffer(
+    doodle_lua_state *s, 
+    const char *script, 
+    size_t size, 
+    script_cache *cache, 
+    doodle_image **img, 
+    doodle_config *conf
+) {
+    int status = cache != NULL
+        ? script_cache_load(cache, s->L, script, size, CHUNK_NAME)
+        : luaL_loadbuffer(s->L, script, size, CHUNK_NAME);
+    return run(s, status, img, NULL, conf, NULL);
+}
+
+static doodle_lua_error *run_file(
+    FILE *in, 
+    script_cache *cache, 
+    doodle_image **img, 
+    doodle_queue **queue, 
+    doodle_config *conf, 
+    FILE *out
+) {
+    doodle_lua_state *s = doodle_lua_prepare(conf->ffi);
+    if (s == NULL) {
+        return new_error(DOODLE_LERR_INIT_FAIL, "lua setup failed");
+    }
+
+    if (cache == NULL) {
+        file_read_data f = { .in = in };
+        int status = lua_load(s->L, read_file, &f, CHUNK_NAME);
+        return run(s, status, img, queue, conf, out);
+    }
+
+    // the cache is keyed by the whole script, so it's read up front
+    size_t size;
+    char *script = read_all(in, &size);
+    if (script == NULL) {
+        doodle_lua_discard(s);
+        return new_error(DOODLE_LERR_LOAD_FAIL, "failed to read script");
+    }
+
+    int status = script_cache_load(cache, s->L, script, size, CHUNK_NAME);
+    doodle_lua_error *err = run(s, status, img, queue, conf, out);
+    free(script);
+    return err;
+}
+
+doodle_lua_error *doodle_lua_run_file(
+    FILE *in, 
+    script_cache *cache, 
+    doodle_image **img, 
+    doodle_config *conf
+) {
+    return run_file(in, cache, img, NULL, conf, NULL);
+}
 
+doodle_lua_error *doodle_lua_stream_file(
+    FILE *in, 
+    script_cache *cache, 
+    doodle_config *conf, 
+    FILE *out
+) {
+    doodle_image *img = NULL;
+    doodle_lua_error *err = run_file(in, cache, &img, NULL, conf, out);
+    free(img);
     return err;
 }
 
+doodle_lua_error *doodle_lua_record_file(
+    FILE *in, 
+    script_cache *cache, 
+    doodle_queue **queue, 
+    doodle_config *conf
+) {
+    doodle_image *img = NULL;
+    *queue = NULL;
+    doodle_lua_error *err = run_file(in, cache, &img, queue, conf, NULL);
+    free(img);
+    return err;
+}
@@ -5,6 +5,8 @@
 #include <stdio.h>
 
 #include "doodle/doodle.h"
+#include "doodle/queue.h"
+#include "script_cache.h"
 
 typedef enum {
     DOODLE_LERR_UNSET_GLOBAL,
@@ -13,6 +15,10 @@ typedef enum {
     DOODLE_LERR_LOAD_FAIL,
     DOODLE_LERR_RUN_FAIL,
     DOODLE_LERR_IMG_N_FAIL,
+    DOODLE_LERR_MEMORY_LIMIT, // the script's own allocations
+    DOODLE_LERR_TIME_LIMIT,
+    DOODLE_LERR_DRAW_LIMIT, // queued draws
+    DOODLE_LERR_PIXEL_LIMIT, // the image
 } doodle_lua_error_type;
 
 typedef struct {
@@ -20,10 +26,50 @@ typedef struct {
     char msg[];
 } doodle_lua_error;
 
+// a lua state set up ahead of the one script it will run
+typedef struct doodle_lua_state doodle_lua_state;
+
+doodle_lua_state *doodle_lua_prepare(bool ffi);
+void doodle_lua_discard(doodle_lua_state *s);
+
+// Runs a script in s, which is used up either way, loading it through cache
+// unless that's NULL. If *img isn't NULL its memory is reused for the image.
+// On return *img holds the image memory, NULL or the caller's to free, even
+// when there's an error.
+doodle_lua_error *doodle_lua_run_buffer(
+    doodle_lua_state *s, 
+    const char *script, 
+    size_t size, 
+    script_cache *cache, 
+    doodle_image **img, 
+    doodle_config *conf
+);
+
 doodle_lua_error *doodle_lua_run_file(
     FILE *in, 
+    script_cache *cache, 
     doodle_image **img, 
     doodle_config *conf
 );
 
+// Runs a script and writes its image to out. With conf->band_height set the
+// image is rendered and written that many rows at a time, unless the script
+// declares a canvas, which needs the whole image.
+doodle_lua_error *doodle_lua_stream_file(
+    FILE *in, 
+    script_cache *cache, 
+    doodle_config *conf, 
+    FILE *out
+);
+
+// Runs a script without rendering it, handing its draws to *queue, the
+// caller's to free, with conf holding the canvas it declared. Scripts that
+// declare a canvas draw as they go, so they can't be recorded.
+doodle_lua_error *doodle_lua_record_file(
+    FILE *in, 
+    script_cache *cache, 
+    doodle_queue **queue, 
+    doodle_config *conf
+);
+
 #endif
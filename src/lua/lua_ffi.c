@@ -0,0 +1,155 @@
+#include <luajit-2.1/lua.h>
+#include <luajit-2.1/lauxlib.h>
+#include <luajit-2.1/lualib.h>
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "lua_ffi.h"
+#include "doodle/doodle.h"
+#include "lua_script.h"
+
+// Run with the ffi library and the script being run, returns the module table.
+// Points and colours are plain cdata structs and draws go straight to the
+// entry points below through ffi.C, so loops over them stay compiled.
+static const char *MODULE =
+    "local ffi, script = ...\n"
+    "ffi.cdef [[\n"
+    "typedef struct { double x, y; } doodle_point;\n"
+    "typedef struct { uint8_t r, g, b, a; } doodle_color;\n"
+    "typedef struct doodle_script doodle_script;\n"
+    "bool doodle_ffi_rect(doodle_script *, const doodle_point *, double, "
+        "double, const doodle_color *);\n"
+    "bool doodle_ffi_circle(doodle_script *, const doodle_point *, double, "
+        "const doodle_color *);\n"
+    "bool doodle_ffi_line(doodle_script *, const doodle_point *, "
+        "const doodle_point *, double, const doodle_color *);\n"
+    "]]\n"
+    "local C, cos, sin, error, type = ffi.C, math.cos, math.sin, error, type\n"
+    "script = ffi.cast('doodle_script *', script)\n"
+    "local point\n"
+    "local methods = {\n"
+    "    add = function(p1, p2) return point(p1.x + p2.x, p1.y + p2.y) end,\n"
+    "    subtract = function(p1, p2)\n"
+    "        return point(p1.x - p2.x, p1.y - p2.y)\n"
+    "    end,\n"
+    "    scale = function(p, f) return point(p.x * f, p.y * f) end,\n"
+    "    polar_offset = function(p, radians, offset)\n"
+    "        return point(\n"
+    "            offset * cos(radians) + p.x, offset * sin(radians) + p.y\n"
+    "        )\n"
+    "    end,\n"
+    "}\n"
+    "point = ffi.metatype('doodle_point', {\n"
+    "    __add = methods.add,\n"
+    "    __sub = methods.subtract,\n"
+    "    __mul = methods.scale,\n"
+    "    __index = methods,\n"
+    "})\n"
+    "local new_color = ffi.typeof('doodle_color')\n"
+    "local color_ptr = ffi.typeof('const doodle_color *')\n"
+    "local function failed() error('failed to queue draw', 3) end\n"
+    "return {\n"
+    "    point = point,\n"
+    // a colour userdata such as WHITE converts once, outside any hot loop
+    "    color = function(r, g, b, a)\n"
+    "        if type(r) == 'userdata' then\n"
+    "            local c = ffi.cast(color_ptr, r)\n"
+    "            return new_color(c.r, c.g, c.b, c.a)\n"
+    "        end\n"
+    "        return new_color(r or 0, g or 0, b or 0, a or 0)\n"
+    "    end,\n"
+    "    rectangle = function(origin, width, height, color)\n"
+    "        if not C.doodle_ffi_rect(\n"
+    "            script, origin, width, height, color\n"
+    "        ) then\n"
+    "            failed()\n"
+    "        end\n"
+    "    end,\n"
+    "    circle = function(origin, radius, color)\n"
+    "        if not C.doodle_ffi_circle(script, origin, radius, color) then\n"
+    "            failed()\n"
+    "        end\n"
+    "    end,\n"
+    "    line = function(p1, p2, thickness, color)\n"
+    "        if not C.doodle_ffi_line(script, p1, p2, thickness, color) then\n"
+    "            failed()\n"
+    "        end\n"
+    "    end,\n"
+    "}\n";
+
+bool doodle_ffi_rect(
+    doodle_script *s, 
+    const doodle_point *origin, 
+    double width, 
+    double height, 
+    const doodle_color *color
+) {
+    doodle_draw d = {
+        .type = DOODLE_DRAW_RECT,
+        .params.rect = {
+            .origin = *origin,
+            .width = width,
+            .height = height,
+            .color = *color,
+        },
+    };
+    return script_push(s, &d);
+}
+
+bool doodle_ffi_circle(
+    doodle_script *s, 
+    const doodle_point *origin, 
+    double radius, 
+    const doodle_color *color
+) {
+    doodle_draw d = {
+        .type = DOODLE_DRAW_CIRCLE,
+        .params.circle = {
+            .origin = *origin,
+            .radius = radius,
+            .color = *color,
+        },
+    };
+    return script_push(s, &d);
+}
+
+bool doodle_ffi_line(
+    doodle_script *s, 
+    const doodle_point *p1, 
+    const doodle_point *p2, 
+    double thickness, 
+    const doodle_color *color
+) {
+    doodle_draw d = {
+        .type = DOODLE_DRAW_LINE,
+        .params.line = {
+            .p1 = *p1,
+            .p2 = *p2,
+            .thickness = thickness,
+            .color = *color,
+        },
+    };
+    return script_push(s, &d);
+}
+
+int set_ffi_module(lua_State *L) {
+    // the JIT compiler only starts once its library is opened, the jit
+    // table itself isn't left for scripts
+    lua_pushcfunction(L, luaopen_jit);
+    lua_call(L, 0, 0);
+    lua_pushnil(L);
+    lua_setglobal(L, "jit");
+
+    if (luaL_loadbuffer(L, MODULE, strlen(MODULE), "doodle ffi") != 0) {
+        return lua_error(L);
+    }
+
+    lua_pushcfunction(L, luaopen_ffi);
+    lua_call(L, 0, 1);
+    lua_pushvalue(L, 1);
+    lua_call(L, 2, 1);
+    lua_setglobal(L, "doodle");
+
+    return 0;
+}
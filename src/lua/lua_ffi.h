@@ -0,0 +1,41 @@
+#ifndef DOODLE_LUA_FFI_H
+#define DOODLE_LUA_FFI_H
+
+#include <luajit-2.1/lua.h>
+#include <luajit-2.1/lauxlib.h>
+#include <luajit-2.1/lualib.h>
+
+#include <stdbool.h>
+
+#include "doodle/doodle.h"
+#include "lua_script.h"
+
+// Entry points called by the ffi module through ffi.C, so they have to be
+// exported from the binary. They return false if the draw couldn't be queued.
+bool doodle_ffi_rect(
+    doodle_script *s, 
+    const doodle_point *origin, 
+    double width, 
+    double height, 
+    const doodle_color *color
+);
+bool doodle_ffi_circle(
+    doodle_script *s, 
+    const doodle_point *origin, 
+    double radius, 
+    const doodle_color *color
+);
+bool doodle_ffi_line(
+    doodle_script *s, 
+    const doodle_point *p1, 
+    const doodle_point *p2, 
+    double thickness, 
+    const doodle_color *color
+);
+
+// Sets the global doodle to the ffi drawing module, drawing into the script
+// given as a light userdata argument. The ffi library can read and write any
+// memory, so this is only for trusted scripts.
+int set_ffi_module(lua_State *L);
+
+#endif
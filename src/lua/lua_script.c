@@ -0,0 +1,240 @@
+#include <luajit-2.1/lua.h>
+#include <luajit-2.1/lauxlib.h>
+#include <luajit-2.1/lualib.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lua_helpers.h"
+#include "lua_script.h"
+#include "doodle/doodle.h"
+#include "doodle/queue.h"
+#include "doodle/render.h"
+
+// draws queued before an immediate mode script's queue is handed off to be
+// rasterized, enough to keep the render workers busy while bounding the
+// memory of the two queues
+#define IMMEDIATE_BATCH 16384
+
+size_t script_memory(const doodle_script *s) {
+    size_t memory = s->lua_memory + doodle_queue_bytes(s->queue) 
+        + s->rendering_bytes;
+    if (s->canvas) {
+        memory += doodle_size(s->conf);
+    }
+    return memory;
+}
+
+bool script_fits(doodle_script *s, size_t extra, doodle_lua_error_type limit) {
+    size_t max = s->conf != NULL ? s->conf->memory_limit : 0;
+    if (max == 0) {
+        return true;
+    }
+
+    size_t memory = script_memory(s);
+    if (memory <= max && extra <= max - memory) {
+        return true;
+    }
+
+    if (!s->over_limit) {
+        s->over_limit = true;
+        s->limit = limit;
+    }
+    return false;
+}
+
+// memory drawing q takes besides q and the image, to optimize it and to bin
+// or cull it
+static size_t batch_bytes(const doodle_script *s, const doodle_queue *q) {
+    size_t bytes = doodle_render_bytes(q, s->conf);
+    if (s->conf->optimize) {
+        bytes += doodle_queue_optimize_bytes(q);
+    }
+    return bytes;
+}
+
+// each batch is drawn over the ones before, so it can be optimized alone
+static void draw_batch(
+    doodle_script *s, 
+    doodle_queue *q, 
+    doodle_queue_stats *stats
+) {
+    *stats = (doodle_queue_stats) { 0 };
+    if (s->conf->optimize) {
+        doodle_queue_optimize(q, s->conf->width, s->conf->height, stats);
+    }
+
+    doodle_render(s->img, q, s->conf);
+    doodle_queue_clear(q);
+}
+
+static void add_stats(doodle_config *conf, const doodle_queue_stats *stats) {
+    conf->stats.culled += stats->culled;
+    conf->stats.duplicates += stats->duplicates;
+    conf->stats.merged += stats->merged;
+}
+
+static void *draw_in_background(void *arg) {
+    doodle_script *s = arg;
+    draw_batch(s, s->rendering, &s->batch_stats);
+    return NULL;
+}
+
+void script_wait(doodle_script *s) {
+    if (!s->drawing) return;
+
+    pthread_join(s->renderer, NULL);
+    s->drawing = false;
+    add_stats(s->conf, &s->batch_stats);
+    s->rendering_bytes = doodle_queue_bytes(s->rendering);
+}
+
+// Hands the full queue to the renderer and carries on with the other one,
+// only waiting if the batch before is still being drawn. Without a second
+// queue or thread the batch is drawn here instead. False if drawing the batch
+// would go over the memory limit.
+static bool hand_off(doodle_script *s) {
+    script_wait(s);
+
+    if (s->rendering == NULL) {
+        s->rendering = doodle_queue_new();
+    }
+    if (s->rendering == NULL) {
+        return script_flush(s);
+    }
+
+    size_t extra = batch_bytes(s, s->queue);
+    if (!script_fits(s, extra, DOODLE_LERR_MEMORY_LIMIT)) {
+        return false;
+    }
+
+    doodle_queue *full = s->queue;
+    s->queue = s->rendering;
+    s->rendering = full;
+    s->rendering_bytes = doodle_queue_bytes(full) + extra;
+
+    s->drawing = pthread_create(
+        &s->renderer, NULL, draw_in_background, s
+    ) == 0;
+    if (!s->drawing) {
+        draw_batch(s, full, &s->batch_stats);
+        add_stats(s->conf, &s->batch_stats);
+        s->rendering_bytes = doodle_queue_bytes(full);
+    }
+    return true;
+}
+
+bool script_push(doodle_script *s, const doodle_draw *d) {
+    // the queue grows a chunk at a time, so it can overshoot by one
+    if (!script_fits(s, 0, DOODLE_LERR_DRAW_LIMIT)) {
+        return false;
+    }
+    if (!doodle_queue_push(s->queue, d)) {
+        return false;
+    }
+
+    if (s->canvas && doodle_queue_length(s->queue) >= IMMEDIATE_BATCH) {
+        return hand_off(s);
+    }
+    return true;
+}
+
+bool script_flush(doodle_script *s) {
+    if (!s->canvas) return true;
+
+    // batches have to land in the order they were drawn
+    script_wait(s);
+
+    if (!script_fits(s, batch_bytes(s, s->queue), DOODLE_LERR_MEMORY_LIMIT)) {
+        return false;
+    }
+
+    doodle_queue_stats stats;
+    draw_batch(s, s->queue, &stats);
+    add_stats(s->conf, &stats);
+    return true;
+}
+
+static bool canvas_size(double n, uint32_t *size) {
+    if (n < 1 || n > UINT32_MAX) {
+        return false;
+    }
+    *size = n;
+    return true;
+}
+
+int set_canvas(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, LUA_ENVIRONINDEX, "script");
+    doodle_script *s = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (s->canvas) {
+        return luaL_error(L, "canvas error: the canvas is already declared");
+    }
+
+    double width, height;
+
+    bool setwidth = geti_number(L, 1, &width);
+    bool setheight = geti_number(L, 2, &height);
+
+    setwidth = getf_number(L, "width", &width) || setwidth;
+    setheight = getf_number(L, "height", &height) || setheight;
+
+    if (!setwidth) {
+        lua_pushfstring(L, NOT_PROVIDED, "canvas", "width");
+        lua_error(L);
+    }
+    if (!setheight) {
+        lua_pushfstring(L, NOT_PROVIDED, "canvas", "height");
+        lua_error(L);
+    }
+
+    doodle_config *conf = s->conf;
+    if (!canvas_size(width, &conf->width)) {
+        return luaL_error(L, "canvas error: width must be a positive integer");
+    }
+    if (!canvas_size(height, &conf->height)) {
+        return luaL_error(L, "canvas error: height must be a positive integer");
+    }
+
+    // the background defaults to the background global
+    lua_getfield(L, 1, "background");
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_rawgeti(L, 1, 3);
+    }
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_getglobal(L, "background");
+    }
+    if (!lua_isuserdata(L, -1) || !has_metatable(L, "doodle.color")) {
+        return luaL_error(L, "canvas error: background must be a doodle.color");
+    }
+    conf->background = *(doodle_color*)lua_touserdata(L, -1);
+    conf->stats = (doodle_queue_stats) { 0 };
+
+    if (!script_fits(s, doodle_size(conf), DOODLE_LERR_PIXEL_LIMIT)) {
+        return luaL_error(
+            L, "canvas error: the image is over the memory limit"
+        );
+    }
+
+    doodle_image *img = doodle_renew(s->img, conf);
+    if (img == NULL) {
+        return luaL_error(L, "canvas error: image creation failed");
+    }
+    s->img = img;
+    s->canvas = true;
+
+    // the globals a script would otherwise set, for it to read back
+    lua_setglobal(L, "background");
+    lua_pushnumber(L, conf->width);
+    lua_setglobal(L, "width");
+    lua_pushnumber(L, conf->height);
+    lua_setglobal(L, "height");
+
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef DOODLE_LUA_SCRIPT_H
+#define DOODLE_LUA_SCRIPT_H
+
+#include <luajit-2.1/lua.h>
+#include <luajit-2.1/lauxlib.h>
+#include <luajit-2.1/lualib.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "doodle/doodle.h"
+#include "doodle/queue.h"
+#include "lua.h"
+
+// what a running script draws into
+typedef struct doodle_script {
+    doodle_queue *queue;
+    doodle_config *conf;
+    doodle_image *img; // memory to reuse for the image, may be NULL
+    // Set once the script declares its canvas, from then on draws are
+    // rasterized into img in batches as they're issued rather than all at
+    // the end.
+    bool canvas;
+    // In immediate mode a full batch is drawn on a thread of its own while
+    // the script fills the other queue. rendering is that batch's queue, kept
+    // for the next batch once drawn, and drawing is set while the thread runs.
+    doodle_queue *rendering;
+    size_t rendering_bytes;
+    bool drawing;
+    pthread_t renderer;
+    doodle_queue_stats batch_stats;
+    size_t lua_memory; // bytes allocated by the lua state
+    uint64_t deadline; // cpu time in nanoseconds, if conf has a time limit
+    // Set when a limit in conf is broken. A script may catch the error that
+    // follows, but once over a limit it's failed either way.
+    bool over_limit;
+    doodle_lua_error_type limit;
+} doodle_script;
+
+// memory counted against conf->memory_limit
+size_t script_memory(const doodle_script *s);
+
+// false, recording the breach, if extra more bytes would go over the limit
+bool script_fits(doodle_script *s, size_t extra, doodle_lua_error_type limit);
+
+// false if the draw couldn't be queued, because of a limit or no memory
+bool script_push(doodle_script *s, const doodle_draw *d);
+
+// rasterizes and empties the queue, if the canvas has been declared, once the
+// batch before it is drawn, false if that would go over the memory limit
+bool script_flush(doodle_script *s);
+
+// waits for the batch being drawn, if there is one
+void script_wait(doodle_script *s);
+
+// canvas { width, height, background }, creating the image up front
+int set_canvas(lua_State *L);
+
+#endif
@@ -1,44 +1,496 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "daemon.h"
 #include "lua.h"
 #include "doodle/doodle.h"
+#include "doodle/render.h"
+
+static bool parse_u32(const char *arg, uint32_t *n) {
+    char *end;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value > UINT32_MAX) {
+        return false;
+    }
+    *n = value;
+    return true;
+}
+
+static bool parse_size(const char *arg, size_t *n) {
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (*arg == '\0' || *arg == '-' || *end != '\0' || value > SIZE_MAX) {
+        return false;
+    }
+    *n = value;
+    return true;
+}
+
+static const struct { const char *name; doodle_file_type ft; } types[] = {
+    {"png", DOODLE_FT_PNG},
+    {"ppm", DOODLE_FT_PPM},
+    {"pam", DOODLE_FT_PAM},
+    {"raw", DOODLE_FT_RAW},
+    {"qoi", DOODLE_FT_QOI},
+};
+
+static bool parse_file_type(const char *arg, doodle_file_type *ft) {
+    for (size_t i = 0; i < sizeof(types) / sizeof *types; i++) {
+        if (strcmp(arg, types[i].name) == 0) {
+            *ft = types[i].ft;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char *file_type_name(doodle_file_type ft) {
+    for (size_t i = 0; i < sizeof(types) / sizeof *types; i++) {
+        if (types[i].ft == ft) {
+            return types[i].name;
+        }
+    }
+    return "out";
+}
+
+#define MAX_THUMBNAILS 16
+
+// either levels of a mip chain, each half the size of the one before, or
+// sizes given outright
+typedef struct {
+    uint32_t levels;
+    size_t count;
+    struct { uint32_t width, height; } sizes[MAX_THUMBNAILS];
+} thumbnails;
+
+// a number of mip levels, or a comma separated list of widthxheight
+static bool parse_thumbnails(const char *arg, thumbnails *t) {
+    *t = (thumbnails) { 0 };
+    if (parse_u32(arg, &t->levels)) {
+        return t->levels > 0 && t->levels <= MAX_THUMBNAILS;
+    }
+
+    while (t->count < MAX_THUMBNAILS) {
+        char *end;
+        unsigned long width = strtoul(arg, &end, 10);
+        if (end == arg || *end != 'x') return false;
+        arg = end + 1;
+        unsigned long height = strtoul(arg, &end, 10);
+        if (end == arg || width == 0 || height == 0
+            || width > UINT32_MAX || height > UINT32_MAX
+        ) {
+            return false;
+        }
+
+        t->sizes[t->count].width = width;
+        t->sizes[t->count].height = height;
+        t->count++;
+        if (*end == '\0') return true;
+        if (*end != ',') return false;
+        arg = end + 1;
+    }
+    return false;
+}
+
+// Scales img down to each thumbnail and writes them to files named prefix,
+// their size and conf->ft's extension. A thumbnail half the size of the one
+// before is made from that rather than the whole image.
+static bool write_thumbnails(
+    doodle_image *img, 
+    const doodle_config *conf, 
+    const thumbnails *t, 
+    const char *prefix
+) {
+    size_t count = t->levels > 0 ? t->levels : t->count;
+    doodle_image *prev = NULL;
+    uint32_t prev_width = 0, prev_height = 0;
+    bool written = true;
+
+    for (size_t i = 0; i < count && written; i++) {
+        // the chain ends at 1x1, however many levels were asked for
+        if (t->levels > 0 && prev_width == 1 && prev_height == 1) {
+            break;
+        }
+
+        doodle_config level = *conf;
+        if (t->levels > 0) {
+            uint32_t width = i == 0 ? conf->width : prev_width;
+            uint32_t height = i == 0 ? conf->height : prev_height;
+            level.width = width > 1 ? width / 2 : 1;
+            level.height = height > 1 ? height / 2 : 1;
+        } else {
+            level.width = t->sizes[i].width;
+            level.height = t->sizes[i].height;
+        }
+
+        bool halves = prev != NULL 
+            && (uint64_t)level.width * 2 == prev_width 
+            && (uint64_t)level.height * 2 == prev_height;
+        doodle_image *thumb = doodle_downscale(
+            halves ? prev : img, level.width, level.height
+        );
+        if (thumb == NULL) {
+            fprintf(
+                stderr, "failed to scale to %"PRIu32"x%"PRIu32"\n", 
+                level.width, level.height
+            );
+            written = false;
+            break;
+        }
+
+        char name[PATH_MAX];
+        int length = snprintf(
+            name, sizeof name, "%s%"PRIu32"x%"PRIu32".%s", 
+            prefix, level.width, level.height, file_type_name(conf->ft)
+        );
+        FILE *f = NULL;
+        if (length < 0 || (size_t)length >= sizeof name) {
+            fprintf(stderr, "thumbnail prefix too long: %s\n", prefix);
+            written = false;
+        } else if ((f = fopen(name, "wb")) == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", name, strerror(errno));
+            written = false;
+        } else {
+            written = doodle_export(thumb, &level, f);
+            written = fclose(f) == 0 && written;
+        }
+
+        free(prev);
+        prev = thumb;
+        prev_width = level.width;
+        prev_height = level.height;
+    }
+
+    free(prev);
+    return written;
+}
+
+// x,y,width,height with an optional ,scale
+static bool parse_viewport(const char *arg, doodle_viewport *v) {
+    char *end;
+    v->x = strtod(arg, &end);
+    if (end == arg || *end != ',') return false;
+    arg = end + 1;
+    v->y = strtod(arg, &end);
+    if (end == arg || *end != ',') return false;
+    arg = end + 1;
+
+    unsigned long width = strtoul(arg, &end, 10);
+    if (end == arg || *end != ',' || width == 0 || width > UINT32_MAX) {
+        return false;
+    }
+    arg = end + 1;
+    unsigned long height = strtoul(arg, &end, 10);
+    if (end == arg || height == 0 || height > UINT32_MAX) return false;
+    v->width = width;
+    v->height = height;
+
+    v->scale = 1;
+    if (*end == ',') {
+        arg = end + 1;
+        v->scale = strtod(arg, &end);
+        if (end == arg) return false;
+    }
+    return *end == '\0' && v->scale > 0;
+}
+
+// Draws just the viewport of a recorded script, from only the draws under
+// it, and writes it to out.
+static bool write_viewport(
+    const doodle_queue *q, 
+    const doodle_config *conf, 
+    const doodle_viewport *v, 
+    FILE *out
+) {
+    doodle_scene *scene = doodle_scene_new(q, conf);
+    if (scene == NULL) {
+        fputs("failed to index draws\n", stderr);
+        return false;
+    }
+
+    doodle_config view = *conf;
+    view.width = v->width;
+    view.height = v->height;
+    doodle_image *img = NULL;
+    bool written = doodle_render_viewport(scene, v, &img);
+    if (!written) {
+        fputs("failed to render viewport\n", stderr);
+    } else {
+        written = doodle_export(img, &view, out);
+    }
+
+    free(img);
+    doodle_scene_free(scene);
+    return written;
+}
+
+static bool parse_png_profile(const char *arg, doodle_png_profile *profile) {
+    static const struct {
+        const char *name;
+        doodle_png_profile p;
+    } profiles[] = {
+        {"fastest", DOODLE_PNG_FASTEST},
+        {"balanced", DOODLE_PNG_BALANCED},
+        {"smallest", DOODLE_PNG_SMALLEST},
+    };
+    for (size_t i = 0; i < sizeof(profiles) / sizeof *profiles; i++) {
+        if (strcmp(arg, profiles[i].name) == 0) {
+            *profile = profiles[i].p;
+            return true;
+        }
+    }
+    return false;
+}
+
+// a broken limit gets its own exit status so callers can tell them apart
+static int error_status(doodle_lua_error_type et) {
+    switch (et) {
+    case DOODLE_LERR_MEMORY_LIMIT: return 3;
+    case DOODLE_LERR_TIME_LIMIT: return 4;
+    case DOODLE_LERR_DRAW_LIMIT: return 5;
+    case DOODLE_LERR_PIXEL_LIMIT: return 6;
+    default: return EXIT_FAILURE;
+    }
+}
+
+#define SCRIPT_CACHE_MEMORY (64 * 1024 * 1024)
+#define SCRIPT_CACHE_DISK (256 * 1024 * 1024)
+
+static const char *USAGE = 
+    "usage: doodle [-O] [-f] [-F png|ppm|pam|raw|qoi]\n"
+    "              [-P fastest|balanced|smallest] [-p] [-j threads]\n"
+    "              [-T tile_size | -c | -S band_rows] [-C cache_dir]\n"
+    "              [-m memory_bytes] [-t cpu_ms] [-g gc_pause]\n"
+    "              [-G gc_stepmul] [-M levels | -M wxh,...]\n"
+    "              [-o thumbnail_prefix] [-V x,y,w,h[,scale]]\n"
+    "              [-D | script]\n";
 
 int main(int argc, char **argv) {
+    doodle_config conf = {
+        .ft = DOODLE_FT_PNG,
+        .threads = 1,
+    };
+
+    bool serve = false;
+    const char *cache_dir = NULL;
+    thumbnails thumbs = { 0 };
+    const char *thumb_prefix = "thumb-";
+    doodle_viewport viewport = { 0 };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "OfF:P:pj:T:cS:C:m:t:g:G:M:o:V:D")) != -1) {
+        switch (opt) {
+        case 'O':
+            conf.optimize = true;
+            break;
+        case 'f':
+            conf.ffi = true;
+            break;
+        case 'F':
+            if (!parse_file_type(optarg, &conf.ft)) {
+                fprintf(stderr, "invalid format %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            if (!parse_png_profile(optarg, &conf.png_profile)) {
+                fprintf(stderr, "invalid png profile %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            conf.png_parallel = true;
+            break;
+        case 'j':
+            if (!parse_u32(optarg, &conf.threads)) {
+                fprintf(stderr, "invalid thread count %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'T':
+            if (!parse_u32(optarg, &conf.tile_size) || conf.tile_size == 0) {
+                fprintf(stderr, "invalid tile size %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            conf.render = DOODLE_RENDER_TILES;
+            break;
+        case 'c':
+            conf.render = DOODLE_RENDER_CULLED;
+            break;
+        case 'S':
+            if (!parse_u32(optarg, &conf.band_height) 
+                || conf.band_height == 0
+            ) {
+                fprintf(stderr, "invalid band height %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'C':
+            cache_dir = optarg;
+            break;
+        case 'm':
+            if (!parse_size(optarg, &conf.memory_limit)) {
+                fprintf(stderr, "invalid memory limit %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            if (!parse_u32(optarg, &conf.time_limit)) {
+                fprintf(stderr, "invalid time limit %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'g':
+            if (!parse_u32(optarg, &conf.gc_pause) || conf.gc_pause > INT_MAX) {
+                fprintf(stderr, "invalid gc pause %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'G':
+            if (!parse_u32(optarg, &conf.gc_stepmul) 
+                || conf.gc_stepmul > INT_MAX
+            ) {
+                fprintf(stderr, "invalid gc step multiplier %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'M':
+            if (!parse_thumbnails(optarg, &thumbs)) {
+                fprintf(stderr, "invalid thumbnails %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            thumb_prefix = optarg;
+            break;
+        case 'V':
+            if (!parse_viewport(optarg, &viewport)) {
+                fprintf(stderr, "invalid viewport %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'D':
+            serve = true;
+            break;
+        default:
+            fputs(USAGE, stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    bool want_thumbs = thumbs.levels > 0 || thumbs.count > 0;
+    // thumbnails are made from the whole image once it's drawn
+    if (want_thumbs && (serve || conf.band_height > 0)) {
+        fputs(USAGE, stderr);
+        return EXIT_FAILURE;
+    }
+    // a viewport is drawn instead of the whole image
+    bool want_viewport = viewport.width > 0;
+    if (want_viewport && (serve || conf.band_height > 0 || want_thumbs)) {
+        fputs(USAGE, stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (serve) {
+        // the daemon keeps whole images around to reuse them
+        if (argc != optind || conf.band_height > 0) {
+            fputs(USAGE, stderr);
+            return EXIT_FAILURE;
+        }
+        // only a long running daemon sees a script again in memory
+        script_cache *cache = script_cache_new(
+            cache_dir, SCRIPT_CACHE_MEMORY, SCRIPT_CACHE_DISK
+        );
+        if (cache == NULL) {
+            fputs("failed to create script cache\n", stderr);
+            return EXIT_FAILURE;
+        }
+        int status = run_daemon(stdin, stdout, cache, &conf);
+        script_cache_free(cache);
+        return status;
+    }
+
+    // a single run only gains from scripts cached on disk
+    script_cache *cache = NULL;
+    if (cache_dir != NULL) {
+        cache = script_cache_new(cache_dir, 0, SCRIPT_CACHE_DISK);
+        if (cache == NULL) {
+            fputs("failed to create script cache\n", stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
     FILE *in;
 
-    switch (argc) {
-    case 1:
+    switch (argc - optind) {
+    case 0:
         in = stdin;
         break;
-    case 2:
-        in = fopen(argv[1], "r");
+    case 1:
+        in = fopen(argv[optind], "r");
         if (in == NULL) {
-            fprintf(stderr, "failed to open %s: %s\n", argv[1], strerror(errno));
+            fprintf(
+                stderr, "failed to open %s: %s\n", 
+                argv[optind], strerror(errno)
+            );
             return EXIT_FAILURE;
         }
         break;
     default:
         fputs("invalid number of arguements\n", stderr);
+        fputs(USAGE, stderr);
         return EXIT_FAILURE;
     }
 
-    doodle_image *img;
-    doodle_config conf = {
-        .ft = DOODLE_FT_PNG,
-    };
-    doodle_lua_error *err = doodle_lua_run_file(in, &img, &conf);
+    // when streaming the image is written out as it's rendered, for a
+    // viewport only the draws are kept
+    doodle_image *img = NULL;
+    doodle_queue *q = NULL;
+    doodle_lua_error *err = conf.band_height > 0
+        ? doodle_lua_stream_file(in, cache, &conf, stdout)
+        : want_viewport ? doodle_lua_record_file(in, cache, &q, &conf)
+        : doodle_lua_run_file(in, cache, &img, &conf);
     if (err != NULL) {
         fprintf(stderr, "failed to create image: %s\n", err->msg);
-        return EXIT_FAILURE;
+        return error_status(err->et);
+    }
+
+    if (conf.optimize) {
+        fprintf(
+            stderr, 
+            "optimizer removed %zu draws: "
+            "%zu off canvas, %zu duplicates, %zu merged rectangles\n",
+            conf.stats.culled + conf.stats.duplicates + conf.stats.merged,
+            conf.stats.culled, conf.stats.duplicates, conf.stats.merged
+        );
     }
 
-    doodle_export(img, &conf, stdout);
+    int status = EXIT_SUCCESS;
+    if (q != NULL && !write_viewport(q, &conf, &viewport, stdout)) {
+        status = EXIT_FAILURE;
+    }
+    if (img != NULL) {
+        doodle_export(img, &conf, stdout);
+        if (want_thumbs
+            && !write_thumbnails(img, &conf, &thumbs, thumb_prefix)
+        ) {
+            status = EXIT_FAILURE;
+        }
+    }
 
     free(img);
+    doodle_queue_free(q);
     fclose(in);
+    script_cache_free(cache);
 
-    return EXIT_SUCCESS;
+    return status;
 }
@@ -0,0 +1,556 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <luajit-2.1/lua.h>
+#include <luajit-2.1/lauxlib.h>
+#include <luajit-2.1/lualib.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "script_cache.h"
+
+// disk entries are the magic, the source's length, the source and then the
+// bytecode, in a file named for the source's hash
+static const char MAGIC[4] = { 'D', 'L', 'B', 'C' };
+#define HEADER_SIZE (sizeof MAGIC + sizeof(uint64_t))
+#define NAME_SIZE 32
+
+// an entry of either level, in its level's recency list and hash table
+typedef struct node {
+    struct node *prev;
+    struct node *next;
+    struct node *chained; // the next in the same bucket
+    uint64_t hash;
+    size_t size; // bytes counted against the level's limit
+} node;
+
+// Entries most recently used first, and indexed by hash so a lookup doesn't
+// walk the list. The table doubles once it's as full as it has buckets.
+typedef struct {
+    node *head;
+    node *tail;
+    node **buckets;
+    size_t bucket_count; // 0 or a power of 2
+    size_t count;
+    size_t used;
+    size_t limit;
+} level;
+
+typedef struct {
+    node n;
+    size_t source_size;
+    size_t bytecode_size;
+    char data[]; // source then bytecode
+} entry;
+
+// The disk level only keeps each file's hash and size. The directory is read
+// once, when the cache is made, and after that kept up to date as files are
+// written, found and removed.
+struct script_cache {
+    level memory;
+    level disk;
+    char *dir;
+};
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t cap;
+} dump_buffer;
+
+// FNV-1a, only used to find candidates
+static uint64_t hash_source(const char *source, size_t size) {
+    uint64_t h = 14695981039346656037u;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ (unsigned char)source[i]) * 1099511628211u;
+    }
+    return h;
+}
+
+static node **bucket(const level *l, uint64_t hash) {
+    return &l->buckets[hash & (l->bucket_count - 1)];
+}
+
+// the first of the entries that may have this hash
+static node *level_find(const level *l, uint64_t hash) {
+    return l->bucket_count > 0 ? *bucket(l, hash) : NULL;
+}
+
+static void unlink_node(level *l, node *n) {
+    if (n->prev != NULL) n->prev->next = n->next;
+    else l->head = n->next;
+    if (n->next != NULL) n->next->prev = n->prev;
+    else l->tail = n->prev;
+}
+
+static void push_front(level *l, node *n) {
+    n->prev = NULL;
+    n->next = l->head;
+    if (l->head != NULL) l->head->prev = n;
+    else l->tail = n;
+    l->head = n;
+}
+
+static void level_touch(level *l, node *n) {
+    unlink_node(l, n);
+    push_front(l, n);
+}
+
+// rehashes into twice the buckets, a table that can't grow keeps its chains
+static void level_grow(level *l) {
+    size_t count = l->bucket_count > 0 ? l->bucket_count * 2 : 64;
+    node **buckets = calloc(count, sizeof *buckets);
+    if (buckets == NULL) return;
+
+    level grown = { .buckets = buckets, .bucket_count = count };
+    for (node *n = l->head; n != NULL; n = n->next) {
+        node **b = bucket(&grown, n->hash);
+        n->chained = *b;
+        *b = n;
+    }
+    free(l->buckets);
+    l->buckets = buckets;
+    l->bucket_count = count;
+}
+
+// false, leaving n the caller's, if there's no table to index it in
+static bool level_add(level *l, node *n) {
+    if (l->count >= l->bucket_count) {
+        level_grow(l);
+    }
+    if (l->bucket_count == 0) {
+        return false;
+    }
+
+    node **b = bucket(l, n->hash);
+    n->chained = *b;
+    *b = n;
+    push_front(l, n);
+    l->count++;
+    l->used += n->size;
+    return true;
+}
+
+// takes n out of the level, it's then the caller's to free
+static void level_remove(level *l, node *n) {
+    node **link = bucket(l, n->hash);
+    while (*link != n) link = &(*link)->chained;
+    *link = n->chained;
+
+    unlink_node(l, n);
+    l->count--;
+    l->used -= n->size;
+}
+
+static entry *memory_find(
+    script_cache *c, 
+    uint64_t hash, 
+    const char *source, 
+    size_t size
+) {
+    for (node *n = level_find(&c->memory, hash); n != NULL; n = n->chained) {
+        entry *e = (entry*)n;
+        if (n->hash == hash && e->source_size == size
+            && memcmp(e->data, source, size) == 0
+        ) {
+            level_touch(&c->memory, n);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void memory_store(
+    script_cache *c, 
+    uint64_t hash, 
+    const char *source, 
+    size_t size, 
+    const char *bytecode, 
+    size_t bytecode_size
+) {
+    level *l = &c->memory;
+    size_t total = sizeof(entry) + size + bytecode_size;
+    if (total > l->limit) return;
+
+    entry *e = malloc(total);
+    if (e == NULL) return;
+
+    e->n.hash = hash;
+    e->n.size = total;
+    e->source_size = size;
+    e->bytecode_size = bytecode_size;
+    memcpy(e->data, source, size);
+    memcpy(e->data + size, bytecode, bytecode_size);
+
+    while (l->tail != NULL && l->used + total > l->limit) {
+        node *old = l->tail;
+        level_remove(l, old);
+        free(old);
+    }
+
+    if (!level_add(l, &e->n)) {
+        free(e);
+    }
+}
+
+static void entry_path(const script_cache *c, uint64_t hash, char *path) {
+    sprintf(path, "%s/%016"PRIx64".ljbc", c->dir, hash);
+}
+
+static node *disk_node(const script_cache *c, uint64_t hash) {
+    node *n = level_find(&c->disk, hash);
+    while (n != NULL && n->hash != hash) n = n->chained;
+    return n;
+}
+
+// counts a file of size bytes for hash as the most recently used, replacing
+// what was known of it before
+static void disk_track(script_cache *c, uint64_t hash, size_t size) {
+    node *n = disk_node(c, hash);
+    if (n != NULL) {
+        level_remove(&c->disk, n);
+    } else {
+        n = malloc(sizeof *n);
+        if (n == NULL) return;
+    }
+
+    *n = (node) { .hash = hash, .size = size };
+    if (!level_add(&c->disk, n)) {
+        free(n);
+    }
+}
+
+// removes the least recently used files until the rest fit, apart from keep
+static void disk_evict(script_cache *c, const node *keep) {
+    level *l = &c->disk;
+    char *path = malloc(strlen(c->dir) + NAME_SIZE);
+    if (path == NULL) return;
+
+    while (l->tail != NULL && l->used > l->limit && l->tail != keep) {
+        node *old = l->tail;
+        // a file that's already gone isn't using space either
+        entry_path(c, old->hash, path);
+        unlink(path);
+        level_remove(l, old);
+        free(old);
+    }
+
+    free(path);
+}
+
+// Reads the bytecode cached on disk for source, the caller frees it. A hit
+// is marked as recently used by updating the file's modification time.
+static char *disk_find(
+    script_cache *c, 
+    uint64_t hash, 
+    const char *source, 
+    size_t size, 
+    size_t *bytecode_size
+) {
+    char *path = malloc(strlen(c->dir) + NAME_SIZE);
+    if (path == NULL) return NULL;
+    entry_path(c, hash, path);
+
+    char *bytecode = NULL;
+    char *data = NULL;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        // removed from under the cache
+        node *n = disk_node(c, hash);
+        if (n != NULL) {
+            level_remove(&c->disk, n);
+            free(n);
+        }
+        goto disk_find_exit;
+    }
+
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || (size_t)st.st_size < HEADER_SIZE + size) {
+        goto disk_find_exit;
+    }
+
+    size_t file_size = st.st_size;
+    data = malloc(file_size);
+    if (data == NULL || fread(data, 1, file_size, f) != file_size) {
+        goto disk_find_exit;
+    }
+
+    uint64_t source_size;
+    memcpy(&source_size, data + sizeof MAGIC, sizeof source_size);
+    if (memcmp(data, MAGIC, sizeof MAGIC) != 0 || source_size != size
+        || memcmp(data + HEADER_SIZE, source, size) != 0
+    ) {
+        goto disk_find_exit;
+    }
+
+    *bytecode_size = file_size - HEADER_SIZE - size;
+    bytecode = malloc(*bytecode_size + 1);
+    if (bytecode == NULL) goto disk_find_exit;
+    memcpy(bytecode, data + HEADER_SIZE + size, *bytecode_size);
+
+    // the modification time orders the files for the next scan
+    futimens(fileno(f), NULL);
+    disk_track(c, hash, file_size);
+
+disk_find_exit:
+    if (f != NULL) fclose(f);
+    free(data);
+    free(path);
+    return bytecode;
+}
+
+typedef struct {
+    uint64_t hash;
+    size_t size;
+    struct timespec used;
+} disk_entry;
+
+static int by_use(const void *a, const void *b) {
+    const disk_entry *da = a;
+    const disk_entry *db = b;
+    if (da->used.tv_sec != db->used.tv_sec) {
+        return da->used.tv_sec < db->used.tv_sec ? -1 : 1;
+    }
+    if (da->used.tv_nsec != db->used.tv_nsec) {
+        return da->used.tv_nsec < db->used.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+static bool entry_name_hash(const char *name, uint64_t *hash) {
+    size_t len = strlen(name);
+    if (len != 21 || strcmp(name + 16, ".ljbc") != 0) {
+        return false;
+    }
+
+    *hash = 0;
+    for (size_t i = 0; i < 16; i++) {
+        char ch = name[i];
+        int digit = ch >= '0' && ch <= '9' ? ch - '0'
+            : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+            : -1;
+        if (digit < 0) return false;
+        *hash = *hash << 4 | digit;
+    }
+    return true;
+}
+
+// Reads the files already in the directory into the disk level, least
+// recently used first, and trims it to its limit. This is the only time the
+// directory is listed.
+static void disk_scan(script_cache *c) {
+    DIR *dir = opendir(c->dir);
+    if (dir == NULL) return;
+
+    size_t path_size = strlen(c->dir) + NAME_SIZE;
+    char *path = malloc(path_size);
+    disk_entry *entries = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+
+    struct dirent *d;
+    while (path != NULL && (d = readdir(dir)) != NULL) {
+        uint64_t hash;
+        if (!entry_name_hash(d->d_name, &hash)) continue;
+
+        snprintf(path, path_size, "%s/%s", c->dir, d->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0) continue;
+
+        if (count == cap) {
+            cap = cap > 0 ? cap * 2 : 64;
+            disk_entry *grown = realloc(entries, cap * sizeof *entries);
+            if (grown == NULL) goto disk_scan_exit;
+            entries = grown;
+        }
+
+        entries[count++] = (disk_entry) {
+            .hash = hash,
+            .size = st.st_size,
+            .used = st.st_mtim,
+        };
+    }
+
+    if (count > 0) {
+        qsort(entries, count, sizeof *entries, by_use);
+    }
+    for (size_t i = 0; i < count; i++) {
+        disk_track(c, entries[i].hash, entries[i].size);
+    }
+    disk_evict(c, NULL);
+
+disk_scan_exit:
+    free(entries);
+    free(path);
+    closedir(dir);
+}
+
+// writes the entry to a temporary file first so readers never see half of it
+static void disk_store(
+    script_cache *c, 
+    uint64_t hash, 
+    const char *source, 
+    size_t size, 
+    const char *bytecode, 
+    size_t bytecode_size
+) {
+    size_t file_size = HEADER_SIZE + size + bytecode_size;
+    if (file_size > c->disk.limit) return;
+
+    size_t path_size = strlen(c->dir) + NAME_SIZE + 32;
+    char *path = malloc(path_size);
+    char *tmp = malloc(path_size);
+    if (path == NULL || tmp == NULL) goto disk_store_exit;
+
+    entry_path(c, hash, path);
+    snprintf(tmp, path_size, "%s.%ld.tmp", path, (long)getpid());
+
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) goto disk_store_exit;
+
+    uint64_t source_size = size;
+    bool written = fwrite(MAGIC, 1, sizeof MAGIC, f) == sizeof MAGIC
+        && fwrite(&source_size, 1, sizeof source_size, f) == sizeof source_size
+        && fwrite(source, 1, size, f) == size
+        && fwrite(bytecode, 1, bytecode_size, f) == bytecode_size;
+    written = fclose(f) == 0 && written;
+
+    if (!written || rename(tmp, path) != 0) {
+        unlink(tmp);
+        goto disk_store_exit;
+    }
+
+    disk_track(c, hash, file_size);
+    disk_evict(c, disk_node(c, hash));
+
+disk_store_exit:
+    free(path);
+    free(tmp);
+}
+
+script_cache *script_cache_new(
+    const char *dir, 
+    size_t memory_limit, 
+    size_t disk_limit
+) {
+    script_cache *c = malloc(sizeof *c);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    *c = (script_cache) {
+        .memory.limit = memory_limit,
+        .disk.limit = dir != NULL ? disk_limit : 0,
+    };
+
+    if (c->disk.limit > 0) {
+        c->dir = malloc(strlen(dir) + 1);
+        if (c->dir == NULL) {
+            free(c);
+            return NULL;
+        }
+        strcpy(c->dir, dir);
+
+        // an existing directory is fine, any other failure shows up as misses
+        mkdir(dir, 0700);
+        disk_scan(c);
+    }
+
+    return c;
+}
+
+static void level_free(level *l) {
+    for (node *n = l->head; n != NULL;) {
+        node *tmp = n;
+        n = n->next;
+        free(tmp);
+    }
+    free(l->buckets);
+}
+
+void script_cache_free(script_cache *c) {
+    if (c == NULL) return;
+
+    level_free(&c->memory);
+    level_free(&c->disk);
+    free(c->dir);
+    free(c);
+}
+
+static int dump_writer(lua_State *L, const void *p, size_t size, void *data) {
+    dump_buffer *b = data;
+    if (b->size + size > b->cap) {
+        size_t cap = b->cap > 0 ? b->cap : 4096;
+        while (cap < b->size + size) cap *= 2;
+        char *grown = realloc(b->data, cap);
+        if (grown == NULL) return 1;
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->size, p, size);
+    b->size += size;
+    return 0;
+}
+
+int script_cache_load(
+    script_cache *c, 
+    lua_State *L,
+    const char *source, 
+    size_t size, 
+    const char *name
+) {
+    uint64_t hash = hash_source(source, size);
+
+    entry *e = memory_find(c, hash, source, size);
+    if (e != NULL) {
+        const char *bytecode = e->data + e->source_size;
+        if (luaL_loadbuffer(L, bytecode, e->bytecode_size, name) == 0) {
+            return 0;
+        }
+        lua_pop(L, 1);
+
+        level_remove(&c->memory, &e->n);
+        free(e);
+    }
+
+    if (c->disk.limit > 0) {
+        size_t bytecode_size;
+        char *bytecode = disk_find(c, hash, source, size, &bytecode_size);
+        if (bytecode != NULL) {
+            int status = luaL_loadbuffer(L, bytecode, bytecode_size, name);
+            if (status == 0) {
+                memory_store(c, hash, source, size, bytecode, bytecode_size);
+                free(bytecode);
+                return 0;
+            }
+            lua_pop(L, 1);
+            free(bytecode);
+        }
+    }
+
+    int status = luaL_loadbuffer(L, source, size, name);
+    if (status != 0) {
+        return status;
+    }
+
+    // a failed dump just leaves the script uncached
+    dump_buffer b = { .data = NULL, .size = 0, .cap = 0 };
+    if (lua_dump(L, dump_writer, &b) == 0 && b.size > 0) {
+        memory_store(c, hash, source, size, b.data, b.size);
+        if (c->disk.limit > 0) {
+            disk_store(c, hash, source, size, b.data, b.size);
+        }
+    }
+    free(b.data);
+
+    return 0;
+}
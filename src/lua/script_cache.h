@@ -0,0 +1,35 @@
+#ifndef DOODLE_SCRIPT_CACHE_H
+#define DOODLE_SCRIPT_CACHE_H
+
+#include <luajit-2.1/lua.h>
+#include <luajit-2.1/lauxlib.h>
+#include <luajit-2.1/lualib.h>
+
+#include <stddef.h>
+
+// Compiled scripts keyed by a hash of their source, held in memory and, if
+// given a directory, on disk. Each level drops its least recently used
+// scripts to stay within its limit in bytes, a limit of 0 turns it off.
+// The cached source is compared on every hit, so a hash collision is only a
+// miss. The directory is only listed when the cache is made, files other
+// processes write to it later are counted once they're hit.
+typedef struct script_cache script_cache;
+
+script_cache *script_cache_new(
+    const char *dir, 
+    size_t memory_limit, 
+    size_t disk_limit
+);
+void script_cache_free(script_cache *c);
+
+// Like luaL_loadbuffer, but loads the script's bytecode when it's cached and
+// caches it when it isn't.
+int script_cache_load(
+    script_cache *c, 
+    lua_State *L,
+    const char *source, 
+    size_t size, 
+    const char *name
+);
+
+#endif
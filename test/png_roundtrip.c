@@ -0,0 +1,189 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <png.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "doodle/doodle.h"
+
+// Encodes images on the parallel PNG encoder with every profile, decodes
+// them again with libpng and checks the pixels are the ones drawn.
+
+#define THREADS 4
+#define RAW_HEADER_SIZE 16
+
+typedef struct {
+    const char *name;
+    uint32_t width, height;
+    uint32_t colors; // drawn from a set this size, 0 for noise
+    bool translucent;
+    // the last pixel is drawn clipped, so its colour isn't in the palette
+    bool unlisted;
+} test_case;
+
+static const test_case cases[] = {
+    {"one row", 300, 1, 0, true},
+    {"one row indexed", 1000, 1, 3, false},
+    // a 256 KiB block is exactly one filtered RGB row, so every block ends
+    // on the end of a row
+    {"block ends on a row", 87381, 4, 0, false},
+    {"indexed block ends on a row", 262143, 3, 200, true},
+    {"few colours", 517, 233, 12, true},
+    {"several idat chunks", 600, 600, 0, true},
+    {"colour missing from the palette", 40, 30, 5, false, true},
+    {"translucent colour missing from the palette", 40, 30, 5, true, true},
+};
+
+static const struct {
+    const char *name;
+    doodle_png_profile profile;
+} profiles[] = {
+    {"fastest", DOODLE_PNG_FASTEST},
+    {"balanced", DOODLE_PNG_BALANCED},
+    {"smallest", DOODLE_PNG_SMALLEST},
+};
+
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1664525 + 1013904223;
+    return *state >> 8;
+}
+
+static doodle_color random_color(const test_case *t, uint32_t *state) {
+    uint32_t n = next_random(state);
+    if (t->colors > 0) {
+        n = n % t->colors * 2654435761u;
+    }
+    return (doodle_color) {
+        .r = n,
+        .g = n >> 8,
+        .b = n >> 16,
+        .a = t->translucent ? (n >> 4) % 3 * 100 : 0,
+    };
+}
+
+static doodle_image *draw_case(const test_case *t) {
+    doodle_config conf = { .width = t->width, .height = t->height };
+    doodle_image *img = doodle_new(&conf);
+    if (img == NULL) {
+        return NULL;
+    }
+
+    uint32_t state = t->width ^ t->height;
+    for (uint32_t y = 0; y < t->height; y++) {
+        for (uint32_t x = 0; x < t->width; x++) {
+            doodle_point p = { .x = x, .y = y };
+            doodle_draw_rect(img, p, 0, 0, random_color(t, &state));
+        }
+    }
+
+    if (t->unlisted) {
+        doodle_draw d = {
+            .type = DOODLE_DRAW_RECT,
+            .params.rect = {
+                .origin = { .x = t->width - 1, .y = t->height - 1 },
+                .color = { .r = 1, .g = 2, .b = 3, .a = t->translucent * 50 },
+            },
+        };
+        doodle_region all = { 0, 0, t->width, t->height };
+        doodle_draw_clipped(img, &d, all);
+    }
+    return img;
+}
+
+// writes the image to memory, *data is the caller's to free
+static bool encode(
+    doodle_image *img,
+    const doodle_config *conf,
+    bool png,
+    char **data,
+    size_t *size
+) {
+    FILE *out = open_memstream(data, size);
+    if (out == NULL) {
+        return false;
+    }
+    bool written = png ? doodle_export_png(img, conf, out)
+        : doodle_export_raw(img, out);
+    return fclose(out) == 0 && written;
+}
+
+// decodes the PNG to RGBA and compares it with the raw pixels
+static bool same_pixels(
+    const char *png,
+    size_t png_size,
+    const uint8_t *raw,
+    const test_case *t
+) {
+    png_image decoded = { .version = PNG_IMAGE_VERSION };
+    if (!png_image_begin_read_from_memory(&decoded, png, png_size)) {
+        fprintf(stderr, "    %s\n", decoded.message);
+        return false;
+    }
+    decoded.format = PNG_FORMAT_RGBA;
+
+    size_t size = PNG_IMAGE_SIZE(decoded);
+    uint8_t *pixels = malloc(size);
+    bool same = pixels != NULL
+        && png_image_finish_read(&decoded, NULL, pixels, 0, NULL)
+        && decoded.width == t->width && decoded.height == t->height;
+    if (!same) {
+        fprintf(stderr, "    %s\n", decoded.message);
+    }
+
+    for (size_t i = 0; same && i < size; i += 4) {
+        same = memcmp(pixels + i, raw + i, 4) == 0;
+        if (!same) {
+            fprintf(stderr, "    pixel %zu differs\n", i / 4);
+        }
+    }
+
+    png_image_free(&decoded);
+    free(pixels);
+    return same;
+}
+
+int main(void) {
+    int failed = 0;
+
+    for (size_t c = 0; c < sizeof cases / sizeof *cases; c++) {
+        const test_case *t = &cases[c];
+        doodle_image *img = draw_case(t);
+        char *raw = NULL;
+        size_t raw_size;
+        if (img == NULL || !encode(img, &(doodle_config) { 0 }, false,
+                &raw, &raw_size)
+        ) {
+            fprintf(stderr, "%s: failed to draw\n", t->name);
+            return EXIT_FAILURE;
+        }
+
+        for (size_t p = 0; p < sizeof profiles / sizeof *profiles; p++) {
+            doodle_config conf = {
+                .width = t->width,
+                .height = t->height,
+                .png_profile = profiles[p].profile,
+                .threads = THREADS,
+                .png_parallel = true,
+            };
+            char *png = NULL;
+            size_t png_size;
+            bool ok = encode(img, &conf, true, &png, &png_size)
+                && same_pixels(
+                    png, png_size, (uint8_t *)raw + RAW_HEADER_SIZE, t
+                );
+            printf(
+                "%s %s, %s\n", ok ? "ok  " : "FAIL", t->name, profiles[p].name
+            );
+            failed += !ok;
+            free(png);
+        }
+
+        free(raw);
+        free(img);
+    }
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}